@@ -2,10 +2,119 @@
   For a given TCP port, try connecting to every IP address on the LAN and tell
   which ones succeed.  Attempts connections in parallel.
 
-  Arguments are: TIMEOUT PORT SUBNETS...
+  Arguments are: [OPTIONS] TIMEOUT PORT TARGETS...
 
-  TIMEOUT is seconds (floating point), the maximum amount of time to wait for
-  each connection.
+  Each target is a 24-bit subnet, "x.x.x.0/24", an address, or a host name.
+  Names are resolved in parallel with a built-in stub resolver that asks
+  the first nameserver in /etc/resolv.conf, or --resolver=ADDR[:PORT].
+  --targets=FILE reads more targets from FILE, one per line.
+
+  A target may end in "@PATH" to probe it from inside the network namespace
+  at PATH (e.g. 10.1.0.0/24@/run/netns/pod-a); its open hosts are printed
+  as "ADDR@PATH".  A helper thread switches into the namespaces to create
+  sockets, and all the connects run on one event loop.  --headroom applies
+  to each namespace's own conntrack table and port range.  Names are looked
+  up in scanport's own namespace.  Not with --proxy, --syn, --sorted,
+  --watch, --rdns, --http, --banner or --exec-batch.
+
+  --proxy=socks5://ADDR[:PORT],... reaches the targets through SOCKS5
+  proxies (PORT defaults to 1080), spreading them over the proxies in turn.
+  A target is open if the proxy's CONNECT to it succeeds.  A proxy that
+  fails is reported and left out for the rest of the scan; once none is
+  left, the remaining targets count as unreachable and scanport exits with
+  status 1.  Not with --syn, --watch, --http or --banner.
+
+  --banner prints "ADDR:PORT banner=..." with the first line each open host
+  sends by itself, or "ADDR:PORT - REASON" if it sends nothing.
+
+  With --syn, --http and --banner run alongside the scan, on each open
+  host as soon as its SYN-ACK is in.
+
+  --http[=PATH] sends "HEAD PATH" (default "/") to each open host and
+  prints "ADDR:PORT STATUS Server=..." with the headers named by
+  --http-headers=NAME,... (default Server), or "ADDR:PORT - REASON" if it
+  doesn't answer in HTTP.  --http-get sends GET instead.
+
+  --rdns prints the name of each open host after its address, from a
+  reverse (PTR) lookup, and adds it to the --watch output.  The lookups run
+  in parallel with the scan; a host whose name hasn't come back within
+  --rdns-budget=SECS (default 1) of being found is printed without one.
+
+  The scan sizes itself to the machine: it raises RLIMIT_NOFILE to the hard
+  limit and, inside a cgroup v2 container, reads pids.max, memory.max and
+  cpu.max, then caps the threads, connections and buffers it uses to fit.
+  Unless --exec-jobs says otherwise, it runs no more --exec-batch commands
+  at once than it has CPUs.
+  --debug shows what it found and chose.
+
+  TIMEOUT is seconds, with a decimal fraction down to the nanosecond (e.g.
+  0.0005), the maximum amount of time to wait for each connection.
+
+  --syn sends raw TCP SYN packets instead of connecting, and reports hosts that
+  answer with SYN-ACK.  It needs CAP_NET_RAW.  TIMEOUT is then how long to keep
+  listening for replies after the last SYN is sent.
+
+  Targets this host already has an established connection to on PORT, as
+  sock_diag reports them, are counted open without being probed, and
+  printed first.  --probe-all probes them anyway.
+
+  --headroom=PCT (default 20) holds back new probes while less than PCT
+  percent of the netfilter conntrack table, or of the ephemeral port range,
+  is free.  --progress reports on stderr once a second how many probes
+  have started and whether they are being held back.
+
+  --fingerprint, with --syn, follows each open host with a guess at its OS
+  family and distance in hops, and the TTL, window, MSS, window scale and
+  option order of its SYN-ACK that the guess is based on.
+
+  --sorted prints the open hosts in ascending address order, once the scan is
+  done, instead of in the order the subnets were given.
+
+  --summary=FILE writes a table with, for each subnet, how many hosts were
+  open, refused, timed out or unreachable, and the median time to answer.
+  --summary-json=FILE writes the same as JSON.  FILE may be "-" for stdout.
+  --summary-prefix=N groups by /N instead of /24.  Times to answer are the
+  kernel's: the handshake RTT from TCP_INFO for connections, and the
+  receive timestamp of the reply for --syn.
+
+  --watch keeps running after the scan, holding an idle connection to each
+  open host, and prints "ADDR:PORT down REASON" when one is lost and
+  "ADDR:PORT up LATENCY" when it is back.  Dead peers are found with TCP
+  keepalive; --keepalive=SECS (default 10) is roughly how long that takes.
+
+  --listen=PATH, with --watch or check, also answers queries about the
+  latest state of each endpoint on a Unix socket at PATH; see QueryServer.
+  scanport query PATH ADDR:PORT... asks such a process, and
+  scanport subscribe PATH [ADDR[/LEN] [PORT [OUTCOME,...]]] follows its
+  changes of state as they happen.
+
+  scanport merge FILES... merges sorted result files into one sorted list
+  without duplicates.  Lines are "ADDR" or "ADDR:PORT".
+
+  --ring=FILE writes every probe result as a fixed-size record into a
+  memory-mapped ring in FILE (e.g. under /dev/shm), which co-located
+  consumers can follow with scanport_ring.h, or with scanport ring FILE.
+  --ring-size=N sets the number of records it holds, default 1048576.  A
+  ring of that size already in FILE is carried on from its last record.
+
+  --exec-batch=CMD runs the shell command CMD on the open hosts, appending
+  up to --batch-size=N (default 100) addresses as arguments, or writing them
+  one per line to its stdin with --exec-stdin.  SCANPORT_PORT is set to the
+  port.  At most --exec-jobs=N (default 4) commands run at once.
+
+  scanport check TIMEOUT INTERVAL FILE probes each "ADDR:PORT" in FILE every
+  INTERVAL seconds (with jitter) and prints "ADDR:PORT up LATENCY" or
+  "ADDR:PORT down REASON" whenever an endpoint changes state.
+
+  scanport lan6 TIMEOUT PORT IFACE finds the IPv6 hosts on the link at
+  IFACE, from the answers to an ICMPv6 echo to all nodes (ff02::1) and the
+  kernel's neighbor cache, and prints those accepting connections on PORT,
+  e.g. "fe80::1%eth0".  The echo needs CAP_NET_RAW or a ping socket.  The
+  connects keep to the same limits and the default --headroom as a scan.
+
+  scanport snapshot create|dump|query|and|diff ... stores sorted results in a
+  compact delta-encoded file with a skip index, and answers membership,
+  intersection and difference queries on that file directly.
 
   Examples:
 
@@ -20,11 +129,35 @@
 #include <iostream>
 #include <stdexcept>
 #include <future>
+#include <atomic>
+#include <thread>
 #include <vector>
+#include <functional>
+#include <queue>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <libgen.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdio.h>
@@ -33,10 +166,24 @@
 #include <unistd.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/icmp6.h>
+#include <net/if.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include <fcntl.h>
+#include <endian.h>
+#include <poll.h>
 #include <cmath>
 #include <cassert>
-#include <regex>
+#include <chrono>
+#include <random>
+#include "scanport_ring.h"
 
 namespace
 {
@@ -50,59 +197,228 @@ std::string errStr()
   return strerror(errno);
 }
 
-std::string try_host(timeval timeout, std::string ipaddr, int port)
+/* Dotted-quad text for every octet value, so formatting an address is four
+   table copies instead of divisions and string concatenation. */
+struct OctetTable
+{
+  char text[256][4];
+  uint8_t len[256];
+
+  OctetTable()
+  {
+    for (int i = 0; i < 256; ++i)
+      len[i] = snprintf(text[i], sizeof(text[i]), "%d", i);
+  }
+};
+
+OctetTable const octets;
+
+size_t const IPV4_MAXLEN = 15;  // "255.255.255.255"
+
+/* Write ADDR (host byte order) as dotted-quad text into OUT, which must have
+   room for IPV4_MAXLEN chars.  No terminating NUL is written.  Returns the
+   number of chars written. */
+size_t format_ipv4(uint32_t addr, char* out)
+{
+  char* p = out;
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    unsigned o = (addr >> shift) & 0xff;
+    memcpy(p, octets.text[o], 4); // the table rows are padded, copy all 4
+    p += octets.len[o];
+    *p++ = '.';
+  }
+  return p - out - 1;
+}
+
+std::string ipv4_string(uint32_t addr)
+{
+  char buf[IPV4_MAXLEN + 1];
+  return std::string(buf, format_ipv4(addr, buf));
+}
+
+/* Parse a dotted-quad address from [P, END) into ADDR (host byte order).
+   On success, advances P past the address and returns true.  Accepts exactly
+   four decimal octets of one to three digits each. */
+bool parse_ipv4(char const*& p, char const* end, uint32_t& addr)
+{
+  char const* q = p;
+  uint32_t a = 0;
+  for (int i = 0; i < 4; ++i)
+  {
+    if (i != 0)
+    {
+      if (q == end or *q != '.')
+        return false;
+      ++q;
+    }
+    unsigned o = 0;
+    char const* digits = q;
+    while (q != end and q - digits < 3 and unsigned(*q - '0') < 10)
+      o = o * 10 + (*q++ - '0');
+    if (q == digits or o > 255)
+      return false;
+    a = a << 8 | o;
+  }
+  p = q;
+  addr = a;
+  return true;
+}
+
+/* Write ADDR to stdout on a line by itself. */
+void print_ipv4(uint32_t addr)
+{
+  char buf[IPV4_MAXLEN + 1];
+  size_t n = format_ipv4(addr, buf);
+  buf[n++] = '\n';
+  fwrite(buf, 1, n, stdout);
+}
+
+using Clock = std::chrono::steady_clock;
+
+enum class Outcome
+{
+  open,                         // connected, or SYN-ACK
+  refused,                      // connection refused, or RST
+  timeout,                      // no answer within the timeout
+  unreachable,                  // host or network unreachable, host down
+  closed,                       // an established connection was lost
+};
+
+/* What happened when probing one address. */
+struct Probe
+{
+  Outcome outcome;
+  Clock::duration latency;      // until the answer, if there was one
+};
+
+/* D as a timespec, for ppoll() and timerfd_settime(). */
+timespec to_timespec(Clock::duration d)
+{
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+  if (ns < 0)
+    ns = 0;
+  return{ time_t(ns / 1000000000), long(ns % 1000000000) };
+}
+
+/* Classify a connect() error. */
+Outcome connect_outcome(int err)
+{
+  switch (err)
+  {
+  case 0:
+    return Outcome::open;
+  case ECONNREFUSED:
+    return Outcome::refused;
+  case ETIMEDOUT:
+    return Outcome::timeout;
+  default:
+    return Outcome::unreachable;
+  }
+}
+
+/* The round trip of the handshake on the just-connected socket FD, as the
+   kernel measured it, or FALLBACK if it isn't available.  This leaves out
+   how long we took to notice the connection. */
+Clock::duration handshake_rtt(int fd, Clock::duration fallback)
+{
+  tcp_info info{};
+  socklen_t len = sizeof(info);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1 or
+      info.tcpi_rtt == 0)
+    return fallback;
+  return std::chrono::microseconds(info.tcpi_rtt);
+}
+
+/* A result packed as an integer that sorts in (address, port) order. */
+uint64_t result_key(uint32_t addr, uint16_t port)
+{
+  return uint64_t(addr) << 16 | port;
+}
+
+/* Whether ERR, from socket() or connect(), is a shortage that may pass,
+   of file descriptors, kernel memory or local ports, so the attempt is
+   worth repeating later rather than counting as a result. */
+bool resource_shortage(int err)
+{
+  return err == EMFILE or err == ENFILE or err == ENOBUFS or err == ENOMEM or
+    err == EADDRNOTAVAIL;
+}
+
+/* How long try_host() keeps retrying an address while there is a
+   resource_shortage() before giving up. */
+auto const SHORTAGE_PATIENCE = std::chrono::seconds(30);
+
+/* Try to connect to ADDR (host byte order) on PORT, waiting at most
+   TIMEOUT. */
+Probe try_host(Clock::duration timeout, uint32_t addr, int port)
 {
   int sockfd = -1;
   std::shared_ptr<void> finally{ nullptr,
       // make sure this socket gets closed
       [&sockfd](void*) { close(sockfd); }
   };
-  for (;;)
-  {
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd >= 0)
-      break;
-    if (errno != EMFILE) // "Too many open files"
-      throw std::runtime_error("socket: " + errStr());
-    usleep(10000);
-  }
 
   sockaddr_in sa{};
   sa.sin_family = AF_INET;
   sa.sin_port = htons(port);
-  if (inet_pton(AF_INET, ipaddr.c_str(), &sa.sin_addr) <= 0)
-    throw std::runtime_error("inet_pton: " + ipaddr + ": " + errStr());
-
-  if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
-    throw std::runtime_error("fcntl: " + errStr());
+  sa.sin_addr.s_addr = htonl(addr);
 
-  if (connect(sockfd, (sockaddr*) &sa, sizeof(sa)) == 0)
+  // Other threads' sockets close as their probes finish, so wait for a
+  // shortage to pass, but not forever.
+  auto give_up = Clock::now() + SHORTAGE_PATIENCE;
+  auto start = Clock::now();
+  for (;;)
   {
+    if (sockfd != -1)
+      close(sockfd);
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd >= 0)
+    {
+      if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
+        throw std::runtime_error("fcntl: " + errStr());
+      start = Clock::now();
+      if (connect(sockfd, (sockaddr*) &sa, sizeof(sa)) == 0)
+      {
+        if (debug)
+          std::clog << ipv4_string(addr) + " - connected immediately\n";
+        return{ Outcome::open, handshake_rtt(sockfd, Clock::now() - start) };
+      }
+    }
+    if (not resource_shortage(errno) or Clock::now() >= give_up)
+      break;
     if (debug)
-      std::clog << ipaddr + " - connected immediately\n";
-    return ipaddr;
+      std::clog << ipv4_string(addr) + " - " + errStr() + "\n";
+    usleep(10000);
   }
-  if (errno == EHOSTDOWN)
+  if (sockfd == -1)
+    throw std::runtime_error("socket: " + errStr());
+  if (errno == EHOSTDOWN || errno == EHOSTUNREACH || errno == ENETUNREACH ||
+      errno == ECONNREFUSED)
   {
     if (debug)
-      std::clog << ipaddr + " - host down\n";
-    return {};
+      std::clog << ipv4_string(addr) + " - " + errStr() + "\n";
+    return{ connect_outcome(errno), Clock::now() - start };
   }
   if (errno != EINPROGRESS)
-    throw std::runtime_error("connect " + ipaddr + ": " + errStr());
+    throw std::runtime_error("connect " + ipv4_string(addr) + ": " + errStr());
 
-  fd_set fdset;
-  FD_ZERO(&fdset);
-  FD_SET(sockfd, &fdset);
-  int r = select(sockfd + 1, nullptr, &fdset, nullptr, &timeout);
+  // ppoll() takes the timeout to the nanosecond and sleeps on a
+  // high-resolution timer.
+  pollfd pfd{ sockfd, POLLOUT, 0 };
+  timespec ts = to_timespec(timeout);
+  int r;
+  while ((r = ppoll(&pfd, 1, &ts, nullptr)) == -1 and errno == EINTR)
+    ts = to_timespec(start + timeout - Clock::now());
   if (r == -1)
-    throw std::runtime_error("select: " + errStr());
+    throw std::runtime_error("ppoll: " + errStr());
   if (r == 0)
   {
     if (debug)
-      std::clog << ipaddr + " - timeout\n";
-    return {};
+      std::clog << ipv4_string(addr) + " - timeout\n";
+    return{ Outcome::timeout, {} };
   }
+  auto latency = Clock::now() - start;
 
   int err = 0;
   socklen_t len = sizeof(err);
@@ -112,110 +428,5538 @@ std::string try_host(timeval timeout, std::string ipaddr, int port)
   if (err != 0)
   {
     if (debug)
-      std::clog << ipaddr + " - not connected\n";
-    return {};
+      std::clog << ipv4_string(addr) + " - not connected: " + strerror(err) +
+        "\n";
+    return{ connect_outcome(err), latency };
   }
 
   if (debug)
-    std::clog << ipaddr + " - connected, fd=" + std::to_string(sockfd) + "\n";
-  return ipaddr;
+    std::clog << ipv4_string(addr) + " - connected, fd=" +
+      std::to_string(sockfd) + "\n";
+  return{ Outcome::open, handshake_rtt(sockfd, latency) };
 }
 
-template <typename T>
-T string_to(std::string const&);
+/* Internet checksum (RFC 1071).  The one's complement sum does not depend on
+   byte order, so buffers are summed as native words into a 64-bit accumulator
+   and the folded result is stored into a header without byte swapping. */
 
-/* Convert a string representation of a floating point number into a timeval
-   object, seconds and microseconds. */
-template <>
-timeval string_to(std::string const& s)
+uint64_t csum_add64(uint64_t sum, uint64_t v)
 {
-  try
+  sum += v;
+  return sum + (sum < v);       // end-around carry
+}
+
+uint64_t csum_add(void const* data, size_t len, uint64_t sum)
+{
+  auto p = static_cast<unsigned char const*>(data);
+  for (; len >= 4; p += 4, len -= 4)
   {
-    size_t idx;
-    double v = std::stod(s, &idx);
-    if (idx == s.size())
+    uint32_t w;
+    memcpy(&w, p, 4);
+    sum = csum_add64(sum, w);
+  }
+  if (len >= 2)
+  {
+    uint16_t w;
+    memcpy(&w, p, 2);
+    sum = csum_add64(sum, w);
+    p += 2, len -= 2;
+  }
+  if (len)
+  {
+    uint16_t w = 0;             // pad the odd byte with zero
+    memcpy(&w, p, 1);
+    sum = csum_add64(sum, w);
+  }
+  return sum;
+}
+
+/* Fold a partial sum down to 16 bits and complement it. */
+uint16_t csum_fold(uint64_t sum)
+{
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+/* Incrementally update CHECK for a 32-bit field changing from FROM to TO,
+   HC' = ~(~HC + ~m + m') per RFC 1624. */
+void csum_replace4(uint16_t& check, uint32_t from, uint32_t to)
+{
+  uint64_t sum = static_cast<uint16_t>(~check);
+  sum += static_cast<uint32_t>(~from);
+  sum += to;
+  check = csum_fold(sum);
+}
+
+struct SynPacket
+{
+  iphdr ip;
+  tcphdr tcp;
+  uint8_t options[20];
+};
+static_assert(sizeof(SynPacket) == 60, "SynPacket must not be padded");
+
+/* The sequence number we send to DADDR.  A SYN-ACK is ours only if it
+   acknowledges this value, so no per-target state needs to be kept. */
+uint32_t syn_cookie(uint32_t secret, uint32_t daddr)
+{
+  uint32_t h = daddr ^ secret;
+  h ^= h >> 16;
+  h *= 0x7feb352d;
+  h ^= h >> 15;
+  h *= 0x846ca68b;
+  h ^= h >> 16;
+  return h;
+}
+
+/* The address the kernel would use as source when talking to DADDR. */
+in_addr source_address(in_addr daddr)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    throw std::runtime_error("socket: " + errStr());
+  std::shared_ptr<void> finally{ nullptr, [fd](void*) { close(fd); } };
+  sockaddr_in sa{};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(9);
+  sa.sin_addr = daddr;
+  if (connect(fd, (sockaddr*) &sa, sizeof(sa)) == -1)
+    throw std::runtime_error("connect: " + errStr());
+  socklen_t len = sizeof(sa);
+  if (getsockname(fd, (sockaddr*) &sa, &len) == -1)
+    throw std::runtime_error("getsockname: " + errStr());
+  return sa.sin_addr;
+}
+
+/* The first line of the file at PATH, or "" if it can't be read. */
+std::string read_line(std::string const& path)
+{
+  std::string line;
+  if (FILE* f = fopen(path.c_str(), "r"))
+  {
+    char buf[256];
+    if (fgets(buf, sizeof(buf), f))
+      line = buf;
+    fclose(f);
+  }
+  return line;
+}
+
+/* Read the number in the file at PATH, as found under /proc and /sys, into
+   V.  Returns false if the file is missing or says "max". */
+bool read_number(std::string const& path, uint64_t& v)
+{
+  std::string line = read_line(path);
+  char* end;
+  errno = 0;
+  unsigned long long n = strtoull(line.c_str(), &end, 10);
+  if (end == line.c_str() or errno != 0)
+    return false;
+  v = n;
+  return true;
+}
+
+/* The connection tracking table and ephemeral port range of a network
+   namespace.  Files under /proc/sys/net show the namespace of the thread
+   that opened them, so open() reads those of the caller's namespace, and
+   keeps nf_conntrack_count open to read it again later from any thread. */
+struct NetLimits
+{
+  int conntrack_count_fd = -1;  // -1 if there is no connection tracking
+  uint64_t conntrack_max = 0;
+  size_t ports = 0;
+
+  static NetLimits open()
+  {
+    NetLimits limits;
+    uint64_t max;
+    if (read_number(CONNTRACK + "max", max) and max > 0)
     {
-      double i;
-      double f = modf(v, &i);
-      decltype(timeval::tv_sec) sec = i;
-      if (sec == i)             // check for overflow
-      {
-        decltype(timeval::tv_usec) usec = f * 1e6;
-        return{ sec, usec };
-      }
+      limits.conntrack_count_fd = ::open((CONNTRACK + "count").c_str(),
+                                         O_RDONLY | O_CLOEXEC);
+      if (limits.conntrack_count_fd != -1)
+        limits.conntrack_max = max;
     }
+    unsigned lo, hi;
+    if (sscanf(read_line("/proc/sys/net/ipv4/ip_local_port_range").c_str(),
+               "%u %u", &lo, &hi) == 2 and hi >= lo)
+      limits.ports = hi - lo + 1;
+    return limits;
   }
-  catch (std::exception&)
-  {}
-  throw std::invalid_argument("Invalid floating point number '" + s + '\'');
+
+  static std::string const CONNTRACK;
+};
+
+std::string const NetLimits::CONNTRACK =
+  "/proc/sys/net/netfilter/nf_conntrack_";
+
+/* Holds back new probes while the netfilter connection tracking table or
+   the ephemeral port range is close to full, so that a big sweep doesn't
+   crowd out other traffic on the host: each probe takes a conntrack entry,
+   which outlives it by a while, and each connection an ephemeral port.
+   HEADROOM is the fraction of each to leave free.  The limits are those of
+   LIMITS, by default scanport's own network namespace, and the conntrack
+   count is read again every 100ms.  With PROGRESS, it also reports on
+   stderr, once a second, how far the scan has got and whether it is being
+   held back, starting the line with LABEL if given. */
+class Throttle
+{
+public:
+  Throttle(double headroom, size_t total, bool progress,
+           NetLimits limits = NetLimits::open(), std::string label = "")
+    : headroom_(headroom), total_(total), progress_(progress),
+      count_fd_(limits.conntrack_count_fd),
+      conntrack_max_(limits.conntrack_max), ports_(limits.ports),
+      label_(std::move(label))
+  {
+    refresh(Clock::now());
+  }
+
+  ~Throttle()
+  {
+    if (count_fd_ != -1)
+      close(count_fd_);
+  }
+
+  Throttle(Throttle const&) = delete;
+  Throttle& operator=(Throttle const&) = delete;
+
+  /* Whether another probe may start now, with IN_FLIGHT connections open.
+     If so, it is counted as started. */
+  bool admit(size_t in_flight)
+  {
+    auto now = Clock::now();
+    if (now >= next_refresh_)
+      refresh(now);
+    char const* reason = nullptr;
+    if (conntrack_max_ and conntrack_count_ + pending_ >=
+        conntrack_max_ * (1 - headroom_))
+      reason = "conntrack";
+    else if (ports_ and in_flight >= ports_ * (1 - headroom_))
+      reason = "ports";
+    if (reason)
+      throttled_ = reason;
+    else
+    {
+      ++started_;
+      ++pending_;               // not in conntrack_count_ yet
+    }
+    if ((progress_ or (debug and throttled_)) and now >= next_report_)
+      report(in_flight);
+    return not reason;
+  }
+
+  /* Take back the last admit() when the probe couldn't start after all,
+     so that it isn't counted twice when admitted again. */
+  void cancel()
+  {
+    --started_;
+    if (pending_ > 0)           // unless refresh() has counted it already
+      --pending_;
+  }
+
+private:
+  void refresh(Clock::time_point now)
+  {
+    char buf[32];
+    ssize_t n;
+    if (count_fd_ != -1 and
+        (n = pread(count_fd_, buf, sizeof(buf) - 1, 0)) > 0)
+    {
+      buf[n] = '\0';
+      conntrack_count_ = strtoull(buf, nullptr, 10);
+    }
+    pending_ = 0;
+    next_refresh_ = now + std::chrono::milliseconds(100);
+  }
+
+  void report(size_t in_flight)
+  {
+    std::string line = std::string(program_name) + ": " +
+      (label_.empty() ? "" : label_ + ": ") + std::to_string(started_) +
+      '/' + std::to_string(total_) + " started, " +
+      std::to_string(in_flight) + " in flight";
+    if (conntrack_max_)
+      line += ", conntrack " + std::to_string(conntrack_count_ + pending_) +
+        '/' + std::to_string(conntrack_max_);
+    if (throttled_)
+      line += std::string(", throttled by ") + throttled_;
+    std::clog << line + "\n";
+    throttled_ = nullptr;
+    next_report_ = Clock::now() + std::chrono::seconds(1);
+  }
+
+  double headroom_;
+  size_t total_;
+  bool progress_;
+  int count_fd_;                // nf_conntrack_count, or -1
+  uint64_t conntrack_max_;      // 0 if there is no connection tracking
+  uint64_t conntrack_count_ = 0;
+  uint64_t pending_ = 0;
+  size_t ports_;
+  std::string label_;
+  size_t started_ = 0;
+  char const* throttled_ = nullptr; // why, if held back since the report
+  Clock::time_point next_refresh_;
+  Clock::time_point next_report_;
+};
+
+/* What a SYN-ACK gives away about the host's TCP stack, for free. */
+struct Fingerprint
+{
+  uint8_t ttl = 0;
+  uint16_t window = 0;
+  uint16_t mss = 0;             // 0 if not given
+  int8_t wscale = -1;           // -1 if not given
+  char options[16] = "";        // option kinds in order, e.g. "MSTNW"
+};
+
+/* Fill in FP from the IP and TCP headers of a SYN-ACK.  TCP, of N bytes,
+   includes the options. */
+void take_fingerprint(iphdr const* ip, tcphdr const* tcp, size_t n,
+                      Fingerprint& fp)
+{
+  fp.ttl = ip->ttl;
+  fp.window = ntohs(tcp->window);
+  auto opt = reinterpret_cast<uint8_t const*>(tcp + 1);
+  auto end = reinterpret_cast<uint8_t const*>(tcp) +
+    std::min<size_t>(n, tcp->doff * 4);
+  size_t k = 0;
+  while (opt < end and k + 1 < sizeof(fp.options))
+  {
+    uint8_t kind = *opt;
+    if (kind == TCPOPT_EOL)
+    {
+      fp.options[k++] = 'E';
+      break;
+    }
+    if (kind == TCPOPT_NOP)
+    {
+      fp.options[k++] = 'N';
+      ++opt;
+      continue;
+    }
+    if (opt + 1 >= end or opt[1] < 2 or opt + opt[1] > end)
+      break;
+    switch (kind)
+    {
+    case TCPOPT_MAXSEG:
+      fp.options[k++] = 'M';
+      if (opt[1] == TCPOLEN_MAXSEG)
+        fp.mss = opt[2] << 8 | opt[3];
+      break;
+    case TCPOPT_WINDOW:
+      fp.options[k++] = 'W';
+      if (opt[1] == TCPOLEN_WINDOW)
+        fp.wscale = opt[2];
+      break;
+    case TCPOPT_SACK_PERMITTED:
+      fp.options[k++] = 'S';
+      break;
+    case TCPOPT_TIMESTAMP:
+      fp.options[k++] = 'T';
+      break;
+    default:
+      fp.options[k++] = '?';
+      break;
+    }
+    opt += opt[1];
+  }
+  fp.options[k] = '\0';
 }
 
-template <>
-uint16_t string_to(std::string const& s)
+/* A rough guess at the OS family behind FP, and how many hops away it is,
+   from the usual initial TTLs (64, 128, 255) and the order in which common
+   stacks put their SYN-ACK options. */
+struct Classification
 {
-  try
+  char const* family;
+  int hops;
+};
+
+Classification classify(Fingerprint const& fp)
+{
+  int initial = fp.ttl <= 32 ? 32 : fp.ttl <= 64 ? 64 : fp.ttl <= 128 ? 128
+    : 255;
+  Classification c{ "unknown", initial - fp.ttl };
+  std::string opts = fp.options;
+  if (initial == 64)
   {
-    size_t idx;
-    auto v = std::stoul(s, &idx);
-    uint16_t r = v;
-    if (r == v and idx == s.size())
-      return r;
+    if (opts == "MSTNW" or opts == "MNNSNW" or opts == "MSNNW" or
+        opts == "MNNS")
+      c.family = "linux";
+    else if (opts.compare(0, 5, "MNWNN") == 0 and
+             opts.find('T') != std::string::npos)
+      c.family = "bsd";
+    else if (opts == "M" or opts.empty())
+      c.family = "embedded";
   }
-  catch (std::exception&)
-  {}
-  throw std::invalid_argument("Invalid integer '" + s + '\'');
+  else if (initial == 128)
+    c.family = "windows";
+  else if (initial == 255)
+    c.family = opts == "M" or opts.empty() ? "network" : "solaris";
+  return c;
 }
 
-} // namespace
+/* Print ADDR with its fingerprint and classification:
+   "ADDR linux hops=3 ttl=61 win=65160 mss=1460 ws=7 opts=MSTNW". */
+void print_fingerprint(uint32_t addr, Fingerprint const& fp)
+{
+  Classification c = classify(fp);
+  char buf[IPV4_MAXLEN + 100];
+  size_t n = format_ipv4(addr, buf);
+  n += snprintf(buf + n, sizeof(buf) - n,
+                " %s hops=%d ttl=%u win=%u mss=%u ws=%d opts=%s\n", c.family,
+                c.hops, fp.ttl, fp.window, fp.mss, fp.wscale,
+                fp.options[0] ? fp.options : "-");
+  fwrite(buf, 1, n, stdout);
+}
 
-int main(int argc, char** argv)
-try
+/* A bounded queue of open addresses from the SYN scan thread to the
+   EventLoop, which learns of new entries through an eventfd.  The scan
+   waits for room before sending each SYN, but replies are always queued,
+   so the queue can run over its capacity by at most the replies to SYNs
+   already in flight. */
+class HitQueue
 {
-  program_name = basename(argv[0]);
+public:
+  explicit HitQueue(size_t capacity)
+    : capacity_(capacity), fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+  {
+    if (fd_ == -1)
+      throw std::runtime_error("eventfd: " + errStr());
+  }
 
-  if (argc > 1 && strcmp(argv[1], "--debug") == 0)
+  ~HitQueue()
   {
-    debug = true;
-    --argc, ++argv;
+    close(fd_);
   }
 
-  if (argc < 4)
-    throw std::runtime_error("wrong usage");
-  auto timeout = string_to<timeval>(*++argv);
-  auto port = string_to<uint16_t>(*++argv);
-  argc -= 3;
+  HitQueue(HitQueue const&) = delete;
+  HitQueue& operator=(HitQueue const&) = delete;
+
+  /* Readable when there are entries to pop or the input is closed. */
+  int fd() const { return fd_; }
+
+  void push(uint32_t addr)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hits_.push_back(addr);
+    if (hits_.size() == 1)
+      signal();
+  }
+
+  /* Block while the queue is full. */
+  void wait_for_room()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    room_.wait(lock, [this]() { return hits_.size() < capacity_; });
+  }
+
+  /* No more entries will be pushed. */
+  void close_input()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    signal();
+  }
+
+  /* Reset fd() once it has been seen readable.  It is signalled again
+     only when a push finds the queue empty, so a consumer that stops short
+     of emptying the queue must come back for the rest by itself. */
+  void ack()
+  {
+    uint64_t n;
+    if (read(fd_, &n, sizeof(n)) == -1 and errno != EAGAIN)
+      throw std::runtime_error("read eventfd: " + errStr());
+  }
+
+  bool pop(uint32_t& addr)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (hits_.empty())
+      return false;
+    addr = hits_.front();
+    hits_.pop_front();
+    if (hits_.size() + 1 == capacity_)
+      room_.notify_one();
+    return true;
+  }
 
-  std::vector<std::string> subnets;
-  subnets.reserve(argc);
-  for (int i = 0; i < argc; ++i)
+  /* Whether the input is closed and everything has been popped. */
+  bool done()
   {
-    std::string subnet{ *++argv };
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ and hits_.empty();
+  }
 
-    // Currently supports only 24-bit IPv4 subnets, "x.x.x.0/24".
-    std::regex subnet_re{R"(^(\d{1,3}\.\d{1,3}\.\d{1,3}\.)\d{1,3}/24$)"};
-    std::smatch matched;
-    if (not std::regex_match(subnet, matched, subnet_re))
-      throw std::runtime_error("Invalid subnet '" + std::string(subnet) + '\'');
-    assert(matched.size() == 2);
-    subnets.emplace_back(matched[1]); // e.g., "10.60.3."
+private:
+  void signal()
+  {
+    uint64_t one = 1;
+    if (write(fd_, &one, sizeof(one)) == -1 and errno != EAGAIN)
+      throw std::runtime_error("write eventfd: " + errStr());
   }
 
-  using Future = std::future<std::string>;
-  std::vector<Future> futures;
-  for (auto& subnet : subnets)
-    for (int i = 1; i < 255; ++i)
+  size_t capacity_;
+  int fd_;
+  std::mutex mutex_;
+  std::condition_variable room_;
+  std::deque<uint32_t> hits_;
+  bool closed_ = false;
+};
+
+/* Send a SYN to PORT on each of the IPADDRS and collect SYN-ACK replies until
+   TIMEOUT after the last one is sent.  ADDRS are in host byte order.  Returns
+   the probe results parallel to ADDRS: open for SYN-ACK, refused for RST, and
+   timeout when nothing came back.
+
+   The packet is built and checksummed once; for each destination only the
+   address and sequence number change, and both checksums are patched
+   incrementally instead of being recomputed.
+
+   OPTS adds to that; see SynOptions. */
+struct SynOptions
+{
+  int rcvbuf = 8 << 20;                  // receive buffer for the replies
+  // If not null, each open address is also pushed on it as soon as its
+  // SYN-ACK arrives, and sending pauses while it is full.
+  HitQueue* hits = nullptr;
+  // If not null, gets the fingerprint of each SYN-ACK, parallel to ADDRS.
+  std::vector<Fingerprint>* prints = nullptr;
+  // If not null, sending pauses while it says to.
+  Throttle* throttle = nullptr;
+};
+
+std::vector<Probe> syn_scan(Clock::duration timeout, int port,
+                            std::vector<uint32_t> const& addrs,
+                            SynOptions const& opts)
+{
+  HitQueue* const hits = opts.hits;
+  std::vector<Fingerprint>* const prints = opts.prints;
+  std::vector<Probe> results(addrs.size(), Probe{ Outcome::timeout, {} });
+  std::vector<int64_t> sent(addrs.size()); // CLOCK_REALTIME, nanoseconds
+  if (prints)
+    prints->assign(addrs.size(), Fingerprint());
+  if (addrs.empty())
+    return results;
+
+  int tx = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+  if (tx < 0)
+    throw std::runtime_error("socket(SOCK_RAW): " + errStr());
+  std::shared_ptr<void> close_tx{ nullptr, [tx](void*) { close(tx); } };
+  int rx = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+  if (rx < 0)
+    throw std::runtime_error("socket(SOCK_RAW): " + errStr());
+  std::shared_ptr<void> close_rx{ nullptr, [rx](void*) { close(rx); } };
+  setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &opts.rcvbuf, sizeof(opts.rcvbuf));
+  if (fcntl(rx, F_SETFL, O_NONBLOCK) == -1)
+    throw std::runtime_error("fcntl: " + errStr());
+  // Have the kernel stamp each reply as it arrives, so the round trip
+  // doesn't include however long the reply sat in the socket buffer while
+  // we were busy sending.
+  int stamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if (setsockopt(rx, SOL_SOCKET, SO_TIMESTAMPING, &stamping,
+                 sizeof(stamping)) == -1 and debug)
+    std::clog << "SO_TIMESTAMPING: " + errStr() + "\n";
+  auto realtime_ns = []() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  };
+
+  std::random_device rd;
+  uint32_t const secret = rd();
+  uint16_t const sport = 32768 + rd() % 28000;
+  in_addr const saddr = source_address(in_addr{ htonl(addrs[0]) });
+  if (debug)
+    std::clog << "source port " + std::to_string(sport) + "\n";
+
+  // Just MSS normally.  To fingerprint, offer the options a Linux client
+  // would, since most stacks answer only the options they were offered.
+  uint8_t const mss[] = { TCPOPT_MAXSEG, TCPOLEN_MAXSEG, 0x05, 0xb4 };
+  uint8_t const full[] = { TCPOPT_MAXSEG, TCPOLEN_MAXSEG, 0x05, 0xb4,
+                           TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED,
+                           TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP,
+                           0, 0, 0, 1, 0, 0, 0, 0,
+                           TCPOPT_NOP, TCPOPT_WINDOW, TCPOLEN_WINDOW, 7 };
+  static_assert(sizeof(full) == sizeof(SynPacket::options), "SYN options");
+  size_t const optlen = prints ? sizeof(full) : sizeof(mss);
+  size_t const len = sizeof(SynPacket) - sizeof(SynPacket::options) + optlen;
+
+  SynPacket pkt{};
+  pkt.ip.version = 4;
+  pkt.ip.ihl = sizeof(iphdr) / 4;
+  pkt.ip.tot_len = htons(len);
+  pkt.ip.id = htons(rd());
+  pkt.ip.ttl = 64;
+  pkt.ip.protocol = IPPROTO_TCP;
+  pkt.ip.saddr = saddr.s_addr;
+  pkt.tcp.source = htons(sport);
+  pkt.tcp.dest = htons(port);
+  pkt.tcp.doff = (sizeof(tcphdr) + optlen) / 4;
+  pkt.tcp.syn = 1;
+  pkt.tcp.window = htons(1024);
+  memcpy(pkt.options, prints ? full : mss, optlen);
+
+  // Template checksums with daddr and seq both zero.
+  pkt.ip.check = csum_fold(csum_add(&pkt.ip, sizeof(pkt.ip), 0));
+  struct
+  {
+    uint32_t saddr, daddr;
+    uint8_t zero, protocol;
+    uint16_t length;
+  } pseudo{ pkt.ip.saddr, 0, 0, IPPROTO_TCP,
+            htons(len - sizeof(pkt.ip)) };
+  uint64_t sum = csum_add(&pseudo, sizeof(pseudo), 0);
+  pkt.tcp.check = csum_fold(csum_add(&pkt.tcp, len - sizeof(pkt.ip),
+                                    sum));
+
+  // Map replies back to the position of the target.
+  std::vector<std::pair<uint32_t, size_t>> index;
+  index.reserve(addrs.size());
+  for (size_t i = 0; i < addrs.size(); ++i)
+    index.emplace_back(addrs[i], i);
+  std::sort(index.begin(), index.end());
+
+  auto drain = [&]() {
+    alignas(iphdr) char buf[1500];
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(scm_timestamping))];
+    for (;;)
     {
-      std::string ipaddr = subnet + std::to_string(i);
-      futures.emplace_back(std::async(std::launch::async, try_host, timeout,
-                                      std::move(ipaddr), port));
+      iovec iov{ buf, sizeof(buf) };
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t n = recvmsg(rx, &msg, 0);
+      if (n == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return;
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error("recv: " + errStr());
+      }
+      auto ip = reinterpret_cast<iphdr const*>(buf);
+      size_t ihl = ip->ihl * 4;
+      if (n < ssize_t(ihl + sizeof(tcphdr)) or ip->protocol != IPPROTO_TCP)
+        continue;
+      auto tcp = reinterpret_cast<tcphdr const*>(buf + ihl);
+      if (tcp->dest != htons(sport) or tcp->source != htons(port) or
+          ntohl(tcp->ack_seq) != syn_cookie(secret, ip->saddr) + 1)
+        continue;
+      uint32_t addr = ntohl(ip->saddr);
+      auto it = std::lower_bound(index.begin(), index.end(),
+                                 std::make_pair(addr, size_t(0)));
+      if (it == index.end() or it->first != addr)
+        continue;
+      Probe& result = results[it->second];
+      if (result.outcome != Outcome::timeout)
+        continue;               // a retransmitted reply
+      int64_t received = 0;
+      for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET and c->cmsg_type == SCM_TIMESTAMPING)
+        {
+          scm_timestamping ts;
+          memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+          received = int64_t(ts.ts[0].tv_sec) * 1000000000 + ts.ts[0].tv_nsec;
+        }
+      if (received == 0)
+        received = realtime_ns();
+      result.latency = std::chrono::nanoseconds(
+        std::max<int64_t>(0, received - sent[it->second]));
+      if (tcp->syn and tcp->ack)
+      {
+        if (debug)
+          std::clog << ipv4_string(addr) + " - syn-ack\n";
+        result.outcome = Outcome::open;
+        if (prints)
+          take_fingerprint(ip, tcp, n - ihl, (*prints)[it->second]);
+        if (hits)
+          hits->push(addr);
+      }
+      else if (tcp->rst)
+      {
+        if (debug)
+          std::clog << ipv4_string(addr) + " - reset\n";
+        result.outcome = Outcome::refused;
+      }
     }
+  };
+
+  sockaddr_in sa{};
+  sa.sin_family = AF_INET;
+  for (size_t i = 0; i < addrs.size(); ++i)
+  {
+    uint32_t daddr = htonl(addrs[i]);
+    uint32_t seq = htonl(syn_cookie(secret, daddr));
+    csum_replace4(pkt.ip.check, pkt.ip.daddr, daddr);
+    csum_replace4(pkt.tcp.check, pkt.ip.daddr, daddr);
+    csum_replace4(pkt.tcp.check, pkt.tcp.seq, seq);
+    pkt.ip.daddr = daddr;
+    pkt.tcp.seq = seq;
+
+    sa.sin_addr.s_addr = daddr;
+    if (hits)
+      hits->wait_for_room();
+    if (opts.throttle)
+      while (not opts.throttle->admit(0))
+      {
+        drain();
+        usleep(10000);
+      }
+    sent[i] = realtime_ns();
+    while (sendto(tx, &pkt, len, 0, (sockaddr*) &sa, sizeof(sa)) == -1)
+    {
+      if (errno != ENOBUFS && errno != EINTR)
+        throw std::runtime_error("sendto " + ipv4_string(addrs[i]) + ": " +
+                                 errStr());
+      drain();
+      usleep(1000);
+    }
+    if (i % 256 == 255)
+      drain();
+  }
+
+  auto deadline = Clock::now() + timeout;
+  for (;;)
+  {
+    drain();
+    auto left = deadline - Clock::now();
+    if (left <= Clock::duration::zero())
+      break;
+    pollfd pfd{ rx, POLLIN, 0 };
+    timespec ts = to_timespec(left);
+    if (ppoll(&pfd, 1, &ts, nullptr) == -1 && errno != EINTR)
+      throw std::runtime_error("ppoll: " + errStr());
+  }
+  return results;
+}
+
+/* Per-subnet rollup of probe outcomes and latency, updated by the probing
+   threads as results come in.  Addresses are grouped by their leading
+   PREFIX bits. */
+class Summary
+{
+public:
+  Summary(std::vector<uint32_t> const& addrs, int prefix)
+    : prefix_(prefix)
+  {
+    for (auto addr : addrs)
+      subnets_.push_back(subnet(addr));
+    std::sort(subnets_.begin(), subnets_.end());
+    subnets_.erase(std::unique(subnets_.begin(), subnets_.end()),
+                   subnets_.end());
+    blocks_.reset(new Block[subnets_.size()]);
+  }
+
+  void add(uint32_t addr, Probe const& probe)
+  {
+    auto it = std::lower_bound(subnets_.begin(), subnets_.end(),
+                               subnet(addr));
+    Block& b = blocks_[it - subnets_.begin()];
+    ++b.counts[int(probe.outcome)];
+    if (probe.outcome == Outcome::open or probe.outcome == Outcome::refused)
+      ++b.latency[bucket(probe.latency)];
+  }
+
+  void print_table(FILE* f) const
+  {
+    fprintf(f, "%-18s %7s %7s %7s %7s %10s\n",
+            "SUBNET", "OPEN", "REFUSED", "TIMEOUT", "UNREACH", "MEDIAN_MS");
+    for (size_t i = 0; i < subnets_.size(); ++i)
+    {
+      Block const& b = blocks_[i];
+      double median = median_ms(b);
+      fprintf(f, "%-18s %7u %7u %7u %7u ", subnet_string(i).c_str(),
+              b.counts[0].load(), b.counts[1].load(), b.counts[2].load(),
+              b.counts[3].load());
+      if (median < 0)
+        fprintf(f, "%10s\n", "-");
+      else
+        fprintf(f, "%10.3f\n", median);
+    }
+  }
+
+  void print_json(FILE* f) const
+  {
+    fprintf(f, "[");
+    for (size_t i = 0; i < subnets_.size(); ++i)
+    {
+      Block const& b = blocks_[i];
+      fprintf(f, "%s\n  {\"subnet\": \"%s\", \"open\": %u, \"refused\": %u, "
+              "\"timeout\": %u, \"unreachable\": %u, \"median_ms\": ",
+              i ? "," : "", subnet_string(i).c_str(), b.counts[0].load(),
+              b.counts[1].load(), b.counts[2].load(), b.counts[3].load());
+      double median = median_ms(b);
+      if (median < 0)
+        fprintf(f, "null}");
+      else
+        fprintf(f, "%.3f}", median);
+    }
+    fprintf(f, "\n]\n");
+  }
+
+private:
+  // Latencies are kept in a log-linear histogram of microseconds: eight
+  // buckets per power of two, so the median is known to within 1/8.
+  static size_t const SUB = 8;
+  static size_t const BUCKETS = 32 * SUB;
+
+  struct Block
+  {
+    std::atomic<unsigned> counts[int(Outcome::closed) + 1]{};
+    std::atomic<unsigned> latency[BUCKETS]{};
+  };
+
+  uint32_t subnet(uint32_t addr) const
+  {
+    return prefix_ == 0 ? 0 : addr >> (32 - prefix_);
+  }
+
+  std::string subnet_string(size_t i) const
+  {
+    uint32_t base = prefix_ == 0 ? 0 : subnets_[i] << (32 - prefix_);
+    return ipv4_string(base) + "/" + std::to_string(prefix_);
+  }
+
+  static size_t bucket(Clock::duration latency)
+  {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+      latency).count();
+    if (us < SUB)
+      return us;
+    int log = 63 - __builtin_clzll(us); // >= 3
+    size_t b = (log - 2) * SUB + ((us >> (log - 3)) & (SUB - 1));
+    return std::min(b, BUCKETS - 1);
+  }
+
+  /* Lower bound in microseconds of the values in bucket B. */
+  static double bucket_us(size_t b)
+  {
+    if (b < SUB)
+      return b;
+    int log = b / SUB + 2;
+    return double((SUB + b % SUB) << (log - 3));
+  }
+
+  /* Median latency in milliseconds, or -1 if nothing answered. */
+  static double median_ms(Block const& b)
+  {
+    uint64_t total = 0;
+    for (auto& n : b.latency)
+      total += n;
+    if (total == 0)
+      return -1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+      seen += b.latency[i];
+      if (seen * 2 >= total)
+        return (bucket_us(i) + bucket_us(i + 1)) / 2 / 1000;
+    }
+    return -1;
+  }
+
+  int prefix_;
+  std::vector<uint32_t> subnets_;
+  std::unique_ptr<Block[]> blocks_;
+};
+
+/* A single-threaded epoll loop with one-shot timers.  Descriptors are
+   level-triggered; each has one handler, which gets the epoll events.
+   Timers are kept to the nanosecond: the loop arms a timerfd for the
+   earliest one instead of rounding the epoll_wait() timeout to
+   milliseconds. */
+class EventLoop
+{
+public:
+  using Handler = std::function<void(uint32_t events)>;
+  using Timer =
+    std::multimap<Clock::time_point, std::function<void()>>::iterator;
+
+  EventLoop()
+    : epfd_(epoll_create1(EPOLL_CLOEXEC)),
+      timerfd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+  {
+    if (epfd_ == -1)
+      throw std::runtime_error("epoll_create1: " + errStr());
+    if (timerfd_ == -1)
+      throw std::runtime_error("timerfd_create: " + errStr());
+    // Nothing to do when it fires: waking up is the point.
+    add(timerfd_, EPOLLIN, [this](uint32_t) {
+        uint64_t n;
+        if (read(timerfd_, &n, sizeof(n)) == -1 and errno != EAGAIN)
+          throw std::runtime_error("read timerfd: " + errStr());
+      });
+  }
+
+  ~EventLoop()
+  {
+    close(timerfd_);
+    close(epfd_);
+  }
+
+  EventLoop(EventLoop const&) = delete;
+  EventLoop& operator=(EventLoop const&) = delete;
+
+  void add(int fd, uint32_t events, Handler handler)
+  {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1)
+      throw std::runtime_error("epoll_ctl: " + errStr());
+    if (size_t(fd) >= handlers_.size())
+      handlers_.resize(fd + 1);
+    handlers_[fd] = std::move(handler);
+  }
+
+  void modify(int fd, uint32_t events)
+  {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == -1)
+      throw std::runtime_error("epoll_ctl: " + errStr());
+  }
+
+  /* Stop watching FD.  The caller still owns and closes it. */
+  void remove(int fd)
+  {
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    handlers_[fd] = nullptr;
+  }
+
+  Timer after(Clock::duration delay, std::function<void()> fn)
+  {
+    return timers_.emplace(Clock::now() + delay, std::move(fn));
+  }
+
+  void cancel(Timer t)
+  {
+    timers_.erase(t);
+  }
+
+  /* Run until stop() is called. */
+  void run()
+  {
+    run_until(Clock::time_point::max());
+  }
+
+  /* Run until stop() is called or DEADLINE has passed. */
+  void run_until(Clock::time_point deadline)
+  {
+    stopped_ = false;
+    epoll_event events[256];
+    while (not stopped_)
+    {
+      auto next = timers_.empty() ? deadline
+        : std::min(deadline, timers_.begin()->first);
+      int wait = -1;
+      if (next <= Clock::now())
+        wait = 0;
+      else if (next != armed_)
+        arm(next);
+      int n = epoll_wait(epfd_, events, 256, wait);
+      if (n == -1)
+      {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error("epoll_wait: " + errStr());
+      }
+      for (int i = 0; i < n; ++i)
+      {
+        int fd = events[i].data.fd;
+        // Copy, since the handler may remove itself.
+        Handler h = handlers_[fd];
+        if (h)
+          h(events[i].events);
+      }
+      auto now = Clock::now();
+      while (not timers_.empty() and timers_.begin()->first <= now)
+      {
+        auto fn = std::move(timers_.begin()->second);
+        timers_.erase(timers_.begin());
+        fn();
+      }
+      if (now >= deadline)
+        break;
+    }
+  }
+
+  void stop()
+  {
+    stopped_ = true;
+  }
+
+private:
+  /* Make the timerfd fire at WHEN, or never if WHEN is max().  Clock is
+     CLOCK_MONOTONIC, so its time points can be used as they are. */
+  void arm(Clock::time_point when)
+  {
+    itimerspec its{};
+    if (when != Clock::time_point::max())
+    {
+      its.it_value = to_timespec(when.time_since_epoch());
+      if (its.it_value.tv_sec == 0 and its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1;  // zero would disarm it
+    }
+    if (timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &its, nullptr) == -1)
+      throw std::runtime_error("timerfd_settime: " + errStr());
+    armed_ = when;
+  }
+
+  int epfd_;
+  int timerfd_;
+  std::vector<Handler> handlers_;
+  std::multimap<Clock::time_point, std::function<void()>> timers_;
+  Clock::time_point armed_ = Clock::time_point::max();
+  bool stopped_ = false;
+};
+
+/* Make SIGINT and SIGTERM stop LOOP, so the long-running modes shut down
+   cleanly.  Returns the signalfd, which the caller closes. */
+int stop_on_signals(EventLoop& loop)
+{
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1)
+    throw std::runtime_error("sigprocmask: " + errStr());
+  int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd == -1)
+    throw std::runtime_error("signalfd: " + errStr());
+  loop.add(fd, EPOLLIN, [&loop](uint32_t) { loop.stop(); });
+  return fd;
+}
+
+/* A new non-blocking TCP socket, or -1 with errno set. */
+int tcp_socket()
+{
+  return socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+/* Start a non-blocking connect on FD, a non-blocking TCP socket, to SA of
+   LEN bytes.  Returns FD, or -1 with errno set (and FD closed) if the
+   connect failed at once. */
+int start_connect(int fd, sockaddr const* sa, socklen_t len)
+{
+  if (connect(fd, sa, len) == 0 or errno == EINPROGRESS)
+    return fd;
+  int err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+/* Start a non-blocking connect to ADDR (host byte order) on PORT, on FD if
+   given, which must be a non-blocking TCP socket, else on a new socket.
+   Returns the socket, or -1 with errno set (and FD closed) if there is no
+   socket or the connect failed at once. */
+int start_connect(uint32_t addr, int port, int fd = -1)
+{
+  if (fd == -1)
+    fd = tcp_socket();
+  if (fd < 0)
+    return -1;
+  sockaddr_in sa{};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(addr);
+  return start_connect(fd, (sockaddr*) &sa, sizeof(sa));
+}
+
+char const* outcome_name(Outcome outcome)
+{
+  switch (outcome)
+  {
+  case Outcome::open:
+    return "open";
+  case Outcome::refused:
+    return "refused";
+  case Outcome::timeout:
+    return "timeout";
+  case Outcome::unreachable:
+    return "unreachable";
+  case Outcome::closed:
+    return "closed";
+  }
+  return "?";
+}
+
+int64_t wall_clock_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/* Writes every probe result into a scanport_ring.h ring file, where
+   co-located consumers can read them straight from shared memory. */
+class RingWriter : public scanport::RingWriter
+{
+public:
+  using scanport::RingWriter::RingWriter;
+
+  void write(uint32_t addr, uint16_t port, Probe const& probe)
+  {
+    scanport::RingWriter::write(
+      addr, port, uint8_t(probe.outcome),
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        probe.latency).count(),
+      wall_clock_us());
+  }
+};
+
+/* Runs a follow-up command on open hosts in batches, instead of once per
+   host.  The command is run by /bin/sh with the batch's addresses appended
+   as arguments, or written one per line to its stdin, and with
+   SCANPORT_PORT set in its environment.  At most JOBS commands run at once;
+   further batches wait for one to finish. */
+class ExecBatch
+{
+public:
+  ExecBatch(std::string const& cmd, uint16_t port, size_t size, size_t jobs,
+            bool use_stdin)
+    : cmd_(cmd), port_(std::to_string(port)), size_(size), jobs_(jobs),
+      use_stdin_(use_stdin)
+  {
+    if (use_stdin)
+      signal(SIGPIPE, SIG_IGN); // a hook that exits early is its business
+  }
+
+  ~ExecBatch()
+  {
+    try
+    {
+      finish();
+    }
+    catch (std::exception&)
+    {}
+  }
+
+  ExecBatch(ExecBatch const&) = delete;
+  ExecBatch& operator=(ExecBatch const&) = delete;
+
+  void add(uint32_t addr)
+  {
+    batch_.push_back(ipv4_string(addr));
+    if (batch_.size() >= size_)
+      flush();
+  }
+
+  /* Run the last, partial batch and wait for every command. */
+  void finish()
+  {
+    flush();
+    while (running_ != 0)
+      reap();
+  }
+
+private:
+  void flush()
+  {
+    if (batch_.empty())
+      return;
+    while (running_ >= jobs_)
+      reap();
+
+    // sh -c 'CMD "$@"' sh ADDR...
+    std::string script = cmd_ + (use_stdin_ ? "" : " \"$@\"");
+    std::vector<char*> argv{ (char*) "sh", (char*) "-c", &script[0],
+                             (char*) "sh" };
+    if (not use_stdin_)
+      for (auto& a : batch_)
+        argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+
+    std::string port_env = "SCANPORT_PORT=" + port_;
+    std::vector<char*> envp;
+    for (char** e = environ; *e; ++e)
+      if (strncmp(*e, "SCANPORT_PORT=", 14) != 0)
+        envp.push_back(*e);
+    envp.push_back(&port_env[0]);
+    envp.push_back(nullptr);
+
+    int pipefd[2] = { -1, -1 };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    std::shared_ptr<void> finally{ nullptr, [&](void*) {
+        posix_spawn_file_actions_destroy(&actions);
+        if (pipefd[0] != -1)
+          close(pipefd[0]);
+      } };
+    if (use_stdin_)
+    {
+      if (pipe2(pipefd, O_CLOEXEC) == -1)
+        throw std::runtime_error("pipe: " + errStr());
+      posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+    }
+
+    fflush(stdout);
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &actions, nullptr, argv.data(),
+                          envp.data());
+    if (err != 0)
+    {
+      if (pipefd[1] != -1)
+        close(pipefd[1]);
+      throw std::runtime_error("posix_spawn: " + std::string(strerror(err)));
+    }
+    ++running_;
+    if (debug)
+      std::clog << "exec: " + std::to_string(batch_.size()) + " hosts, pid " +
+        std::to_string(pid) + "\n";
+
+    if (use_stdin_)
+    {
+      std::string lines;
+      for (auto& a : batch_)
+        lines += a + '\n';
+      close(pipefd[0]);
+      pipefd[0] = -1;
+      for (size_t done = 0; done < lines.size();)
+      {
+        ssize_t n = write(pipefd[1], lines.data() + done,
+                          lines.size() - done);
+        if (n == -1 and errno == EINTR)
+          continue;
+        if (n == -1)
+          break;                // EPIPE: it stopped reading
+        done += n;
+      }
+      close(pipefd[1]);
+    }
+    batch_.clear();
+  }
+
+  /* Wait for one command to finish. */
+  void reap()
+  {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid == -1)
+    {
+      if (errno == EINTR)
+        return;
+      throw std::runtime_error("waitpid: " + errStr());
+    }
+    --running_;
+    if (not WIFEXITED(status) or WEXITSTATUS(status) != 0)
+    {
+      fflush(stdout);
+      std::clog << program_name << ": exec-batch command, pid " << pid
+                << (WIFEXITED(status) ? ", exited with status " :
+                    ", killed by signal ")
+                << (WIFEXITED(status) ? WEXITSTATUS(status) :
+                    WTERMSIG(status)) << std::endl;
+    }
+  }
+
+  std::string cmd_;
+  std::string port_;
+  size_t size_;
+  size_t jobs_;
+  bool use_stdin_;
+  std::vector<std::string> batch_;
+  size_t running_ = 0;
+};
+
+/* Latest known state of an endpoint. */
+struct EndpointState
+{
+  Outcome outcome;              // of the most recent probe
+  uint32_t latency_us;          // of the most recent successful probe
+  int64_t since_us;             // wall clock time it last went up or down
+};
+
+/* Open-addressing hash table, with linear probing, from result key to
+   EndpointState.  Slots are stored inline in one array so a lookup usually
+   touches a single cache line. */
+class StateTable
+{
+public:
+  StateTable()
+    : slots_(1024)
+  {}
+
+  EndpointState const* find(uint64_t key) const
+  {
+    for (size_t i = home(key);; i = (i + 1) & (slots_.size() - 1))
+    {
+      if (slots_[i].key == key)
+        return &slots_[i].state;
+      if (slots_[i].key == EMPTY)
+        return nullptr;
+    }
+  }
+
+  /* Returns the state for KEY, inserting it with outcome OUTCOME and
+     since_us zero if it is new. */
+  EndpointState& get(uint64_t key, Outcome outcome)
+  {
+    if ((size_ + 1) * 2 > slots_.size())
+      grow();
+    size_t i = home(key);
+    for (; slots_[i].key != EMPTY; i = (i + 1) & (slots_.size() - 1))
+      if (slots_[i].key == key)
+        return slots_[i].state;
+    ++size_;
+    slots_[i].key = key;
+    slots_[i].state = EndpointState{ outcome, 0, 0 };
+    return slots_[i].state;
+  }
+
+private:
+  static uint64_t const EMPTY = ~uint64_t(0);
+
+  struct Slot
+  {
+    uint64_t key = EMPTY;
+    EndpointState state;
+  };
+
+  size_t home(uint64_t key) const
+  {
+    return (key * 0x9e3779b97f4a7c15) >> (64 - __builtin_ctzll(slots_.size()));
+  }
+
+  void grow()
+  {
+    std::vector<Slot> old(slots_.size() * 2);
+    old.swap(slots_);
+    size_ = 0;
+    for (auto& slot : old)
+      if (slot.key != EMPTY)
+        get(slot.key, slot.state.outcome) = slot.state;
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+};
+
+/* The latest state of every endpoint seen by a long-running mode.  Each
+   time an endpoint goes up or down, it is printed as "ADDR:PORT up LATENCY"
+   or "ADDR:PORT down REASON", and passed to the change listener if there is
+   one. */
+class Tracker
+{
+public:
+  using Listener = std::function<void(uint32_t addr, uint16_t port,
+                                      EndpointState const&)>;
+  using Namer = std::function<std::string(uint32_t addr)>;
+
+  void on_change(Listener listener)
+  {
+    listener_ = std::move(listener);
+  }
+
+  /* Append the name NAMER gives for the address, if any, to each change
+     printed. */
+  void set_namer(Namer namer)
+  {
+    namer_ = std::move(namer);
+  }
+
+  /* Also write every result, changed or not, to RING. */
+  void set_ring(RingWriter* ring)
+  {
+    ring_ = ring;
+  }
+
+  /* Note the result of probing PORT on ADDR.  The change is printed unless
+     QUIET. */
+  void record(uint32_t addr, uint16_t port, Probe const& probe,
+              bool quiet = false)
+  {
+    if (ring_)
+      ring_->write(addr, port, probe);
+    bool up = probe.outcome == Outcome::open;
+    auto key = result_key(addr, port);
+    bool known = table_.find(key) != nullptr;
+    EndpointState& state = table_.get(key, probe.outcome);
+    bool changed = not known or up != (state.outcome == Outcome::open);
+    state.outcome = probe.outcome;
+    if (up)
+      state.latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        probe.latency).count();
+    if (not changed)
+      return;
+    state.since_us = wall_clock_us();
+    if (quiet)
+      return;
+
+    char buf[IPV4_MAXLEN + 40 + 256];
+    size_t n = format_ipv4(addr, buf);
+    if (up)
+      n += snprintf(buf + n, sizeof(buf) - n, ":%u up %.3fms", port,
+                    std::chrono::duration<double, std::milli>(probe.latency)
+                    .count());
+    else
+      n += snprintf(buf + n, sizeof(buf) - n, ":%u down %s", port,
+                    outcome_name(probe.outcome));
+    std::string name = namer_ ? namer_(addr) : std::string();
+    if (not name.empty())
+    {
+      buf[n++] = ' ';
+      n += name.copy(buf + n, 253);
+    }
+    buf[n++] = '\n';
+    fwrite(buf, 1, n, stdout);
+    fflush(stdout);
+    if (listener_)
+      listener_(addr, port, state);
+  }
+
+  StateTable const& table() const { return table_; }
+
+private:
+  StateTable table_;
+  Listener listener_;
+  Namer namer_;
+  RingWriter* ring_ = nullptr;
+};
+
+/* Holds one idle connection to each endpoint instead of reconnecting to
+   check on it.  TCP keepalive with short intervals detects a dead peer, and
+   EPOLLRDHUP a closed one.  A lost endpoint is reported to the Tracker and
+   then reconnected with exponential backoff until it comes back. */
+class Watcher
+{
+public:
+  Watcher(EventLoop& loop, Tracker& tracker, Clock::duration timeout,
+          int keepalive)
+    : loop_(loop), tracker_(tracker), timeout_(timeout),
+      keepalive_(keepalive)
+  {}
+
+  /* Start watching PORT on ADDR. */
+  void add(uint32_t addr, uint16_t port)
+  {
+    endpoints_.emplace_back();
+    Endpoint& e = endpoints_.back();
+    e.addr = addr;
+    e.port = port;
+    connect(endpoints_.size() - 1);
+  }
+
+private:
+  struct Endpoint
+  {
+    uint32_t addr = 0;
+    uint16_t port = 0;
+    int fd = -1;
+    bool connected = false;
+    Clock::time_point start;
+    Clock::duration backoff{};
+    EventLoop::Timer timer;
+    bool timer_set = false;
+  };
+
+  void connect(size_t i)
+  {
+    Endpoint& e = endpoints_[i];
+    e.connected = false;
+    e.start = Clock::now();
+    e.fd = start_connect(e.addr, e.port);
+    if (e.fd == -1)
+    {
+      if (debug)
+        std::clog << ipv4_string(e.addr) + " - " + errStr() + "\n";
+      if (resource_shortage(errno))
+        retry_later(i);         // says nothing about the endpoint
+      else
+        lost(i, connect_outcome(errno));
+      return;
+    }
+    loop_.add(e.fd, EPOLLOUT | EPOLLRDHUP,
+              [this, i](uint32_t events) { on_event(i, events); });
+    set_timer(i, timeout_, [this, i]() {
+        if (debug)
+          std::clog << ipv4_string(endpoints_[i].addr) + " - timeout\n";
+        lost(i, Outcome::timeout);
+      });
+  }
+
+  void on_event(size_t i, uint32_t events)
+  {
+    Endpoint& e = endpoints_[i];
+    int err = 0;
+    if (events & (EPOLLERR | EPOLLHUP) or not e.connected)
+    {
+      socklen_t len = sizeof(err);
+      if (getsockopt(e.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    }
+    if (not e.connected)
+    {
+      if (err != 0 or events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+      {
+        if (debug)
+          std::clog << ipv4_string(e.addr) + " - not connected: " +
+            strerror(err) + "\n";
+        lost(i, err ? connect_outcome(err) : Outcome::refused);
+        return;
+      }
+      cancel_timer(i);
+      set_keepalive(e.fd);
+      e.connected = true;
+      e.backoff = {};
+      loop_.modify(e.fd, EPOLLIN | EPOLLRDHUP);
+      tracker_.record(e.addr, e.port,
+                      Probe{ Outcome::open,
+                             handshake_rtt(e.fd, Clock::now() - e.start) });
+      return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    {
+      // Keepalive gives up with ETIMEDOUT.
+      lost(i, err == ETIMEDOUT ? Outcome::timeout : Outcome::closed);
+      return;
+    }
+    // The service talked to us.  Discard it, and notice if it hung up.
+    char buf[4096];
+    ssize_t n = read(e.fd, buf, sizeof(buf));
+    if (n == 0 or (n == -1 and errno != EAGAIN and errno != EINTR))
+      lost(i, Outcome::closed);
+  }
+
+  void set_keepalive(int fd)
+  {
+    int on = 1;
+    int count = 3;
+    int interval = std::max(1, keepalive_ / count);
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_, sizeof(keepalive_));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+  }
+
+  /* The connection or connection attempt failed.  Report it, and try again
+     later. */
+  void lost(size_t i, Outcome outcome)
+  {
+    Endpoint& e = endpoints_[i];
+    cancel_timer(i);
+    if (e.fd != -1)
+    {
+      loop_.remove(e.fd);
+      close(e.fd);
+      e.fd = -1;
+    }
+    tracker_.record(e.addr, e.port, Probe{ outcome, {} });
+    retry_later(i);
+  }
+
+  /* Connect to endpoint I again after the next backoff interval. */
+  void retry_later(size_t i)
+  {
+    Endpoint& e = endpoints_[i];
+    e.backoff = std::min<Clock::duration>(
+      std::max<Clock::duration>(e.backoff * 2, std::chrono::seconds(1)),
+      std::chrono::seconds(64));
+    set_timer(i, e.backoff, [this, i]() { connect(i); });
+  }
+
+  void set_timer(size_t i, Clock::duration delay, std::function<void()> fn)
+  {
+    Endpoint& e = endpoints_[i];
+    e.timer = loop_.after(delay, [this, i, fn]() {
+        endpoints_[i].timer_set = false;
+        fn();
+      });
+    e.timer_set = true;
+  }
+
+  void cancel_timer(size_t i)
+  {
+    Endpoint& e = endpoints_[i];
+    if (e.timer_set)
+      loop_.cancel(e.timer);
+    e.timer_set = false;
+  }
+
+  EventLoop& loop_;
+  Tracker& tracker_;
+  Clock::duration timeout_;
+  int keepalive_;
+  std::vector<Endpoint> endpoints_;
+};
+
+/* A hashed timing wheel ticking from a periodic timerfd on an EventLoop.
+   Scheduling is O(1) and firing costs one slot visit per tick, which keeps
+   thousands of always-running per-endpoint timers cheap.  Entries cannot be
+   cancelled; FIRE gets back the ID and TAG given to schedule(), and callers
+   ignore entries whose tag is stale. */
+class TimingWheel
+{
+public:
+  using Fire = std::function<void(uint32_t id, uint32_t tag)>;
+
+  TimingWheel(EventLoop& loop, Clock::duration tick, size_t nslots, Fire fire)
+    : loop_(loop), tick_(tick), slots_(nslots), fire_(std::move(fire)),
+      fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+  {
+    if (fd_ == -1)
+      throw std::runtime_error("timerfd_create: " + errStr());
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(tick)
+      .count();
+    itimerspec its{};
+    its.it_interval.tv_sec = ns / 1000000000;
+    its.it_interval.tv_nsec = ns % 1000000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd_, 0, &its, nullptr) == -1)
+      throw std::runtime_error("timerfd_settime: " + errStr());
+    loop_.add(fd_, EPOLLIN, [this](uint32_t) { on_tick(); });
+  }
+
+  ~TimingWheel()
+  {
+    loop_.remove(fd_);
+    close(fd_);
+  }
+
+  TimingWheel(TimingWheel const&) = delete;
+  TimingWheel& operator=(TimingWheel const&) = delete;
+
+  /* Call FIRE(ID, TAG) after DELAY, rounded up to whole ticks. */
+  void schedule(uint32_t id, uint32_t tag, Clock::duration delay)
+  {
+    uint64_t ticks = (delay + tick_ - Clock::duration(1)) / tick_;
+    ticks = std::max<uint64_t>(ticks, 1);
+    size_t n = slots_.size();
+    slots_[(cursor_ + ticks) % n].push_back(
+      { id, tag, uint32_t((ticks - 1) / n) });
+  }
+
+private:
+  struct Entry
+  {
+    uint32_t id;
+    uint32_t tag;
+    uint32_t rounds;            // full turns of the wheel still to wait
+  };
+
+  void on_tick()
+  {
+    uint64_t expirations;
+    if (read(fd_, &expirations, sizeof(expirations)) != sizeof(expirations))
+      return;
+    while (expirations--)
+    {
+      cursor_ = (cursor_ + 1) % slots_.size();
+      std::vector<Entry> due;
+      due.swap(slots_[cursor_]);
+      for (auto& e : due)
+        if (e.rounds != 0)
+        {
+          --e.rounds;
+          slots_[cursor_].push_back(e);
+        }
+        else
+          fire_(e.id, e.tag);
+    }
+  }
+
+  EventLoop& loop_;
+  Clock::duration tick_;
+  std::vector<std::vector<Entry>> slots_;
+  Fire fire_;
+  int fd_;
+  size_t cursor_ = 0;
+};
+
+/* Repeatedly probes a fixed set of endpoints, each every INTERVAL with
+   +/-10% jitter so probes don't bunch up, and gives each result to the
+   Tracker.  Everything runs on one EventLoop, so a check costs a handful of
+   syscalls and no thread. */
+class HealthChecker
+{
+public:
+  HealthChecker(EventLoop& loop, Tracker& tracker, Clock::duration timeout,
+                Clock::duration interval)
+    : loop_(loop), tracker_(tracker), timeout_(timeout), interval_(interval),
+      wheel_(loop, std::chrono::milliseconds(1), 4096,
+             [this](uint32_t id, uint32_t tag) { on_timer(id, tag); }),
+      rng_(std::random_device{}())
+  {}
+
+  void add(uint32_t addr, uint16_t port)
+  {
+    endpoints_.emplace_back();
+    endpoints_.back().addr = addr;
+    endpoints_.back().port = port;
+    // Spread the first round of probes over the interval.
+    std::uniform_int_distribution<Clock::rep> first(0, interval_.count());
+    wheel_.schedule(endpoints_.size() - 1, 0, Clock::duration(first(rng_)));
+  }
+
+private:
+  struct Endpoint
+  {
+    uint32_t addr = 0;
+    uint16_t port = 0;
+    int fd = -1;
+    uint32_t tag = 0;           // matches the one live wheel entry
+    Clock::time_point start;
+    Clock::duration backoff{};  // while out of sockets or ports
+  };
+
+  void on_timer(uint32_t id, uint32_t tag)
+  {
+    Endpoint& e = endpoints_[id];
+    if (tag != e.tag)
+      return;
+    if (e.fd == -1)
+      probe(id);
+    else
+      done(id, Probe{ Outcome::timeout, {} });
+  }
+
+  void probe(uint32_t id)
+  {
+    Endpoint& e = endpoints_[id];
+    e.start = Clock::now();
+    e.fd = start_connect(e.addr, e.port);
+    if (e.fd == -1 and resource_shortage(errno))
+    {
+      // Try again soon, backing off, without a result for the endpoint.
+      if (debug)
+        std::clog << ipv4_string(e.addr) + " - " + errStr() + "\n";
+      e.backoff = std::min<Clock::duration>(
+        std::max<Clock::duration>(e.backoff * 2,
+                                  std::chrono::milliseconds(10)),
+        interval_);
+      wheel_.schedule(id, ++e.tag, e.backoff);
+      return;
+    }
+    e.backoff = {};
+    if (e.fd == -1)
+    {
+      done(id, Probe{ connect_outcome(errno), Clock::now() - e.start });
+      return;
+    }
+    loop_.add(e.fd, EPOLLOUT, [this, id](uint32_t) {
+        Endpoint& e = endpoints_[id];
+        auto latency = Clock::now() - e.start;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(e.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+          err = errno;
+        if (err == 0)
+          latency = handshake_rtt(e.fd, latency);
+        done(id, Probe{ connect_outcome(err), latency });
+      });
+    wheel_.schedule(id, ++e.tag, timeout_);
+  }
+
+  /* Record the result of a probe and schedule the next one. */
+  void done(uint32_t id, Probe const& probe)
+  {
+    Endpoint& e = endpoints_[id];
+    if (e.fd != -1)
+    {
+      loop_.remove(e.fd);
+      close(e.fd);
+      e.fd = -1;
+    }
+    tracker_.record(e.addr, e.port, probe);
+    std::uniform_int_distribution<Clock::rep> jitter(-interval_.count() / 10,
+                                                     interval_.count() / 10);
+    wheel_.schedule(id, ++e.tag, interval_ + Clock::duration(jitter(rng_)));
+  }
+
+  EventLoop& loop_;
+  Tracker& tracker_;
+  Clock::duration timeout_;
+  Clock::duration interval_;
+  TimingWheel wheel_;
+  std::mt19937_64 rng_;
+  std::vector<Endpoint> endpoints_;
+};
+
+/* Query protocol spoken over the --listen Unix socket.  All integers are
+   big-endian.  Clients may send any number of requests without waiting for
+   the replies, which come back in order.
+
+   Query request, 8 bytes:
+     uint8   op                 QUERY_OP
+     uint8   reserved
+     uint16  port
+     uint32  addr
+
+   Query reply, 16 bytes:
+     uint8   op                 QUERY_OP
+     uint8   state              QUERY_UNKNOWN, QUERY_UP or QUERY_DOWN
+     uint8   outcome            of the latest probe, as enum Outcome
+     uint8   reserved
+     uint32  latency_us         of the latest successful probe
+     int64   since_us           when it went up or down, microseconds since
+                                the epoch
+
+   Subscribe request, 12 bytes, replacing any earlier subscription:
+     uint8   op                 SUBSCRIBE_OP
+     uint8   prefix_len         0 to 32
+     uint16  port               0 for any
+     uint32  addr               with prefix_len, the subnet to watch
+     uint8   outcomes           bit (1 << outcome) set for each outcome
+                                wanted, 0 for all
+     uint8   reserved[3]
+
+   After subscribing, each change of state matching the filter is pushed as
+   an event, 24 bytes:
+     uint8   op                 EVENT_OP
+     ...                        bytes 1-15 as in the query reply
+     uint32  addr
+     uint16  port
+     uint16  reserved
+
+   Events are queued per subscriber up to SUBSCRIBER_BUFFER bytes.  Beyond
+   that they are dropped rather than let a slow reader hold anything up, and
+   once there is room again a 24-byte record with op EVENTS_LOST_OP and a
+   uint32 count at offset 4 says how many were dropped.  Query replies are
+   never dropped; instead, while that much output is waiting for a client,
+   no more of its requests are read. */
+
+uint8_t const QUERY_OP = 1;
+uint8_t const SUBSCRIBE_OP = 2;
+uint8_t const EVENT_OP = 3;
+uint8_t const EVENTS_LOST_OP = 4;
+uint8_t const QUERY_UNKNOWN = 0;
+uint8_t const QUERY_UP = 1;
+uint8_t const QUERY_DOWN = 2;
+size_t const QUERY_REQUEST_SIZE = 8;
+size_t const QUERY_REPLY_SIZE = 16;
+size_t const SUBSCRIBE_REQUEST_SIZE = 12;
+size_t const EVENT_SIZE = 24;
+size_t const SUBSCRIBER_BUFFER = 1024 * EVENT_SIZE;
+
+/* Encode STATE into the first 16 bytes of a query reply or event. */
+void encode_state(char* out, uint8_t op, EndpointState const* state)
+{
+  memset(out, 0, QUERY_REPLY_SIZE);
+  out[0] = op;
+  if (not state)
+    return;
+  out[1] = state->outcome == Outcome::open ? QUERY_UP : QUERY_DOWN;
+  out[2] = uint8_t(state->outcome);
+  uint32_t latency = htobe32(state->latency_us);
+  int64_t since = htobe64(state->since_us);
+  memcpy(out + 4, &latency, 4);
+  memcpy(out + 8, &since, 8);
+}
+
+/* Answers queries about the Tracker's endpoint states over a Unix stream
+   socket, and pushes changes to subscribers. */
+class QueryServer
+{
+public:
+  QueryServer(EventLoop& loop, Tracker& tracker, std::string const& path)
+    : loop_(loop), tracker_(tracker), path_(path)
+  {
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(sa.sun_path))
+      throw std::runtime_error("Socket path too long '" + path + '\'');
+    memcpy(sa.sun_path, path.c_str(), path.size());
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ == -1)
+      throw std::runtime_error("socket: " + errStr());
+    unlink(path.c_str());       // left over from a previous run
+    if (bind(fd_, (sockaddr*) &sa, sizeof(sa)) == -1)
+      throw std::runtime_error("bind " + path + ": " + errStr());
+    if (listen(fd_, 64) == -1)
+      throw std::runtime_error("listen: " + errStr());
+    loop_.add(fd_, EPOLLIN, [this](uint32_t) { on_accept(); });
+    tracker_.on_change([this](uint32_t addr, uint16_t port,
+                              EndpointState const& state) {
+        notify(addr, port, state);
+      });
+  }
+
+  ~QueryServer()
+  {
+    tracker_.on_change(nullptr);
+    for (auto& c : clients_)
+    {
+      loop_.remove(c.first);
+      close(c.first);
+    }
+    loop_.remove(fd_);
+    close(fd_);
+    unlink(path_.c_str());
+  }
+
+  QueryServer(QueryServer const&) = delete;
+  QueryServer& operator=(QueryServer const&) = delete;
+
+private:
+  struct Client
+  {
+    std::string in;
+    std::string out;
+    bool subscribed = false;
+    uint32_t addr = 0;          // subscription filter
+    uint32_t mask = 0;
+    uint16_t port = 0;
+    uint8_t outcomes = 0;
+    uint32_t lost = 0;          // events dropped since the last report
+    uint32_t events = EPOLLIN;  // what the event loop waits for
+  };
+
+  void on_accept()
+  {
+    for (;;)
+    {
+      int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd == -1)
+      {
+        if (errno != EAGAIN and errno != EINTR and debug)
+          std::clog << "accept: " + errStr() + "\n";
+        return;
+      }
+      clients_[fd];
+      loop_.add(fd, EPOLLIN, [this, fd](uint32_t events) {
+          on_client(fd, events);
+        });
+    }
+  }
+
+  void on_client(int fd, uint32_t events)
+  {
+    Client& c = clients_[fd];
+    if (events & EPOLLIN)
+    {
+      char buf[4096];
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n == 0 or (n == -1 and errno != EAGAIN and errno != EINTR))
+      {
+        drop(fd);
+        return;
+      }
+      if (n > 0)
+        c.in.append(buf, n);
+    }
+    for (;;)
+    {
+      size_t pending = c.in.size();
+      if (not take_requests(c) or not flush(fd, c))
+      {
+        drop(fd);
+        return;
+      }
+      // Go on if writing made room for requests that were held back.
+      if (c.in.size() == pending or c.out.size() >= SUBSCRIBER_BUFFER)
+        break;
+    }
+  }
+
+  /* Handle the complete requests in C's input, while there is room for
+     the replies.  Returns false if one is malformed. */
+  bool take_requests(Client& c)
+  {
+    size_t used = 0;
+    while (used < c.in.size() and c.out.size() < SUBSCRIBER_BUFFER)
+    {
+      size_t size = handle(c.in.data() + used, c.in.size() - used, c);
+      if (size == size_t(-1))
+        return false;
+      if (size == 0)
+        break;
+      used += size;
+    }
+    c.in.erase(0, used);
+    return true;
+  }
+
+  /* Handle the request at the start of the LEN bytes at P.  Returns the
+     size of the request, 0 if it is not all there yet, or -1 if it is
+     malformed. */
+  size_t handle(char const* p, size_t len, Client& c)
+  {
+    uint16_t port;
+    uint32_t addr;
+    switch (uint8_t(p[0]))
+    {
+    case QUERY_OP:
+    {
+      if (len < QUERY_REQUEST_SIZE)
+        return 0;
+      memcpy(&port, p + 2, 2);
+      memcpy(&addr, p + 4, 4);
+      char reply[QUERY_REPLY_SIZE];
+      encode_state(reply, QUERY_OP, tracker_.table().find(
+                     result_key(ntohl(addr), ntohs(port))));
+      c.out.append(reply, sizeof(reply));
+      return QUERY_REQUEST_SIZE;
+    }
+    case SUBSCRIBE_OP:
+    {
+      if (len < SUBSCRIBE_REQUEST_SIZE)
+        return 0;
+      uint8_t prefix_len = p[1];
+      if (prefix_len > 32)
+        return -1;
+      memcpy(&port, p + 2, 2);
+      memcpy(&addr, p + 4, 4);
+      c.subscribed = true;
+      c.mask = prefix_len == 0 ? 0 : ~uint32_t(0) << (32 - prefix_len);
+      c.addr = ntohl(addr) & c.mask;
+      c.port = ntohs(port);
+      c.outcomes = p[8];
+      return SUBSCRIBE_REQUEST_SIZE;
+    }
+    default:
+      return -1;
+    }
+  }
+
+  /* Queue an event for each subscriber interested in this change. */
+  void notify(uint32_t addr, uint16_t port, EndpointState const& state)
+  {
+    char event[EVENT_SIZE];
+    encode_state(event, EVENT_OP, &state);
+    uint32_t a = htonl(addr);
+    uint16_t pt = htons(port);
+    memcpy(event + 16, &a, 4);
+    memcpy(event + 20, &pt, 2);
+    memset(event + 22, 0, 2);
+
+    std::vector<int> gone;
+    for (auto& fc : clients_)
+    {
+      Client& c = fc.second;
+      if (not c.subscribed or (addr & c.mask) != c.addr or
+          (c.port != 0 and c.port != port) or
+          (c.outcomes != 0 and not (c.outcomes & (1 << int(state.outcome)))))
+        continue;
+      if (c.out.size() + EVENT_SIZE > SUBSCRIBER_BUFFER)
+      {
+        ++c.lost;
+        continue;
+      }
+      c.out.append(event, sizeof(event));
+      if (not flush(fc.first, c))
+        gone.push_back(fc.first);
+    }
+    for (int fd : gone)
+      drop(fd);
+  }
+
+  /* Write what we can of C's pending output, wait for the socket to be
+     writable if some is left, and stop reading requests while too much is.
+     Returns false if the client is gone. */
+  bool flush(int fd, Client& c)
+  {
+    if (c.lost != 0 and c.out.size() + EVENT_SIZE <= SUBSCRIBER_BUFFER)
+    {
+      char lost[EVENT_SIZE] = { char(EVENTS_LOST_OP) };
+      uint32_t n = htobe32(c.lost);
+      memcpy(lost + 4, &n, 4);
+      c.out.append(lost, sizeof(lost));
+      c.lost = 0;
+    }
+    if (not c.out.empty())
+    {
+      ssize_t n = write(fd, c.out.data(), c.out.size());
+      if (n == -1 and errno != EAGAIN and errno != EINTR)
+        return false;
+      if (n > 0)
+        c.out.erase(0, n);
+    }
+    uint32_t events =
+      (c.out.size() < SUBSCRIBER_BUFFER ? uint32_t(EPOLLIN) : 0) |
+      (c.out.empty() ? 0 : uint32_t(EPOLLOUT));
+    if (c.events != events)
+    {
+      c.events = events;
+      loop_.modify(fd, events);
+    }
+    return true;
+  }
+
+  void drop(int fd)
+  {
+    loop_.remove(fd);
+    close(fd);
+    clients_.erase(fd);
+  }
+
+  EventLoop& loop_;
+  Tracker& tracker_;
+  std::string path_;
+  int fd_ = -1;
+  std::map<int, Client> clients_;
+};
+
+/* A minimal stub DNS resolver on an EventLoop.  Queries go to one
+   recursive server over a single UDP socket, many at a time without waiting
+   for each other's answers, and are retried on timeout.  Answers are cached
+   and concurrent lookups of the same name share one query.  The socket is
+   opened on the first lookup. */
+class Resolver
+{
+public:
+  using Done = std::function<void(std::vector<uint32_t> const& addrs)>;
+  using NameDone = std::function<void(std::string const& name)>;
+
+  Resolver(EventLoop& loop, sockaddr_in server)
+    : loop_(loop), server_(server), rng_(std::random_device{}())
+  {}
+
+  ~Resolver()
+  {
+    for (auto& q : inflight_)
+      loop_.cancel(q.second.timer);
+    if (fd_ != -1)
+    {
+      loop_.remove(fd_);
+      close(fd_);
+    }
+  }
+
+  Resolver(Resolver const&) = delete;
+  Resolver& operator=(Resolver const&) = delete;
+
+  /* Look up the IPv4 addresses of NAME and call DONE with them, or with
+     none if there are none or the server didn't answer. */
+  void resolve(std::string const& name, Done done)
+  {
+    lookup(name, TYPE_A, [done](std::vector<std::string> const& rdata) {
+        std::vector<uint32_t> addrs;
+        for (auto& r : rdata)
+        {
+          auto b = reinterpret_cast<unsigned char const*>(r.data());
+          addrs.push_back(uint32_t(b[0]) << 24 | b[1] << 16 | b[2] << 8 | b[3]);
+        }
+        done(addrs);
+      });
+  }
+
+  /* Look up the name of ADDR (its PTR record) and call DONE with it, or
+     with "" if it has none or the server didn't answer. */
+  void reverse(uint32_t addr, NameDone done)
+  {
+    char qname[IPV4_MAXLEN + 14];
+    snprintf(qname, sizeof(qname), "%u.%u.%u.%u.in-addr.arpa",
+             addr & 0xff, addr >> 8 & 0xff, addr >> 16 & 0xff, addr >> 24);
+    lookup(qname, TYPE_PTR, [done](std::vector<std::string> const& rdata) {
+        done(rdata.empty() ? std::string() : rdata.front());
+      });
+  }
+
+  /* Number of lookups not yet answered. */
+  size_t pending() const
+  {
+    return waiting_.size();
+  }
+
+private:
+  using Answer = std::function<void(std::vector<std::string> const& rdata)>;
+
+  static size_t const MAX_INFLIGHT = 512;
+  static int const TRIES = 3;
+  static uint16_t const TYPE_A = 1;
+  static uint16_t const TYPE_PTR = 12;
+
+  struct Query
+  {
+    std::string key;
+    std::string packet;
+    uint16_t type = 0;
+    int tries = 0;
+    EventLoop::Timer timer;
+  };
+
+  /* Ask for the records of TYPE for NAME and call DONE with their data: the
+     4 bytes of each address for A, the decoded name for PTR. */
+  void lookup(std::string const& name, uint16_t type, Answer done)
+  {
+    std::string key = name;
+    key += '\0';
+    key += char(type);
+    auto cached = cache_.find(key);
+    if (cached != cache_.end())
+    {
+      done(cached->second);
+      return;
+    }
+    auto& waiting = waiting_[key];
+    waiting.push_back(std::move(done));
+    if (waiting.size() == 1)
+    {
+      queue_.push_back(key);
+      pump();
+    }
+  }
+
+  void open_socket()
+  {
+    fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ == -1)
+      throw std::runtime_error("socket: " + errStr());
+    if (connect(fd_, (sockaddr*) &server_, sizeof(server_)) == -1)
+      throw std::runtime_error("connect: " + errStr());
+    int rcvbuf = 4 << 20;
+    setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    loop_.add(fd_, EPOLLIN, [this](uint32_t) { on_readable(); });
+  }
+
+  /* Send queued lookups while there is room in the window. */
+  void pump()
+  {
+    if (fd_ == -1)
+      open_socket();
+    while (not queue_.empty() and inflight_.size() < MAX_INFLIGHT)
+    {
+      std::string key = std::move(queue_.front());
+      queue_.pop_front();
+      uint16_t id;
+      do
+        id = rng_();
+      while (inflight_.count(id));
+      Query& q = inflight_[id];
+      q.key = key;
+      q.type = uint8_t(key.back());
+      q.packet = encode(id, key.substr(0, key.size() - 2), q.type);
+      if (q.packet.empty())
+      {
+        inflight_.erase(id);
+        finish(key, {});
+        continue;
+      }
+      send(id);
+    }
+  }
+
+  void send(uint16_t id)
+  {
+    Query& q = inflight_[id];
+    ++q.tries;
+    if (::send(fd_, q.packet.data(), q.packet.size(), 0) == -1 and debug)
+      std::clog << "send " + q.key.substr(0, q.key.size() - 2) + ": " +
+        errStr() + "\n";
+    q.timer = loop_.after(std::chrono::seconds(1), [this, id]() {
+        Query& q = inflight_[id];
+        if (q.tries < TRIES)
+        {
+          send(id);
+          return;
+        }
+        if (debug)
+          std::clog << q.key.substr(0, q.key.size() - 2) + " - no answer\n";
+        std::string key = q.key;
+        inflight_.erase(id);
+        finish(key, {});
+        pump();
+      });
+  }
+
+  /* A standard query for the records of TYPE for NAME, or "" if NAME is not
+     a valid domain name. */
+  static std::string encode(uint16_t id, std::string const& name,
+                            uint16_t type)
+  {
+    std::string p;
+    char const header[] = { char(id >> 8), char(id), 0x01, 0, // RD
+                            0, 1, 0, 0, 0, 0, 0, 0 };
+    p.append(header, sizeof(header));
+    size_t start = 0;
+    while (start < name.size())
+    {
+      size_t dot = name.find('.', start);
+      if (dot == std::string::npos)
+        dot = name.size();
+      size_t len = dot - start;
+      if (len == 0 or len > 63)
+        return {};
+      p += char(len);
+      p.append(name, start, len);
+      start = dot + 1;
+    }
+    p += '\0';
+    char const question[] = { char(type >> 8), char(type), 0, 1 }; // IN
+    p.append(question, sizeof(question));
+    return p.size() > 512 ? std::string() : p;
+  }
+
+  void on_readable()
+  {
+    unsigned char buf[1500];
+    for (;;)
+    {
+      ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+      if (n == -1)
+        break;
+      if (n < 12)
+        continue;
+      uint16_t id = buf[0] << 8 | buf[1];
+      auto it = inflight_.find(id);
+      if (it == inflight_.end())
+        continue;
+      Query& q = it->second;
+      // The question must be the one we asked.
+      size_t qlen = q.packet.size() - 12;
+      if (size_t(n) < 12 + qlen or not (buf[2] & 0x80) or
+          strncasecmp((char const*) buf + 12, q.packet.data() + 12, qlen) != 0)
+        continue;
+      std::vector<std::string> rdata;
+      parse_answers(buf, n, 12 + qlen, q.type, rdata);
+      loop_.cancel(q.timer);
+      std::string key = std::move(q.key);
+      inflight_.erase(it);
+      finish(key, rdata);
+    }
+    pump();
+  }
+
+  /* Skip the name at POS in the message BUF of N bytes: labels, ending in a
+     zero or a compression pointer. */
+  static size_t skip_name(unsigned char const* buf, size_t n, size_t pos)
+  {
+    while (pos < n and buf[pos] != 0 and (buf[pos] & 0xc0) != 0xc0)
+      pos += buf[pos] + 1;
+    return pos + (pos < n and buf[pos] != 0 ? 2 : 1);
+  }
+
+  /* Decode the name at POS in the message BUF of N bytes, following
+     compression pointers.  Returns "" if it is malformed, or if a label has
+     anything but letters, digits, '-' and '_', which would corrupt the
+     output lines it is printed on. */
+  static std::string read_name(unsigned char const* buf, size_t n, size_t pos)
+  {
+    std::string name;
+    for (int hops = 0; pos < n and hops < 64; ++hops)
+    {
+      unsigned len = buf[pos];
+      if (len == 0)
+        return name;
+      if ((len & 0xc0) == 0xc0)
+      {
+        if (pos + 1 >= n)
+          break;
+        pos = (len & 0x3f) << 8 | buf[pos + 1];
+        continue;
+      }
+      if (pos + 1 + len > n or name.size() + len > 253)
+        break;
+      if (not name.empty())
+        name += '.';
+      for (unsigned k = 1; k <= len; ++k)
+      {
+        unsigned char c = buf[pos + k];
+        if (not (unsigned((c | 0x20) - 'a') < 26 or unsigned(c - '0') < 10 or
+                 c == '-' or c == '_'))
+          return {};
+        name += char(c);
+      }
+      pos += len + 1;
+    }
+    return {};
+  }
+
+  /* Collect the data of the records of TYPE in the answer section of the
+     reply in BUF, whose question ends at offset POS. */
+  static void parse_answers(unsigned char const* buf, size_t n, size_t pos,
+                            uint16_t type, std::vector<std::string>& rdata)
+  {
+    unsigned ancount = buf[6] << 8 | buf[7];
+    for (unsigned i = 0; i < ancount; ++i)
+    {
+      pos = skip_name(buf, n, pos);
+      if (pos + 10 > n)
+        return;
+      unsigned rtype = buf[pos] << 8 | buf[pos + 1];
+      unsigned rdlength = buf[pos + 8] << 8 | buf[pos + 9];
+      pos += 10;
+      if (pos + rdlength > n)
+        return;
+      if (rtype == type and type == TYPE_A and rdlength == 4)
+        rdata.emplace_back(reinterpret_cast<char const*>(buf) + pos, 4);
+      else if (rtype == type and type == TYPE_PTR)
+      {
+        std::string name = read_name(buf, n, pos);
+        if (not name.empty())
+          rdata.push_back(std::move(name));
+      }
+      pos += rdlength;
+    }
+  }
+
+  void finish(std::string const& key, std::vector<std::string> const& rdata)
+  {
+    cache_[key] = rdata;
+    auto it = waiting_.find(key);
+    if (it == waiting_.end())
+      return;
+    auto callbacks = std::move(it->second);
+    waiting_.erase(it);
+    for (auto& done : callbacks)
+      done(rdata);
+  }
+
+  EventLoop& loop_;
+  sockaddr_in server_;
+  int fd_ = -1;
+  std::mt19937 rng_;
+  std::unordered_map<uint16_t, Query> inflight_;
+  std::deque<std::string> queue_;
+  std::unordered_map<std::string, std::vector<Answer>> waiting_;
+  std::unordered_map<std::string, std::vector<std::string>> cache_;
+};
+
+/* Prints open hosts as "ADDR NAME", with the name from a reverse lookup,
+   in the order they are given.  Lookups run in the background on the
+   EventLoop; a host whose name isn't in within BUDGET is printed without
+   one rather than holding up the rest.  Names are remembered for as long as
+   this lives, so --watch can show them too. */
+class ReverseNames
+{
+public:
+  ReverseNames(EventLoop& loop, Resolver& dns, Clock::duration budget)
+    : loop_(loop), dns_(dns), budget_(budget)
+  {}
+
+  ~ReverseNames()
+  {
+    if (armed_)
+      loop_.cancel(timer_);
+  }
+
+  ReverseNames(ReverseNames const&) = delete;
+  ReverseNames& operator=(ReverseNames const&) = delete;
+
+  /* Start looking up the name of ADDR, if that hasn't been done yet. */
+  void prefetch(uint32_t addr)
+  {
+    if (names_.count(addr))
+      return;
+    names_[addr];
+    dns_.reverse(addr, [this, addr](std::string const& name) {
+        Name& n = names_[addr];
+        n.name = name;
+        n.done = true;
+        flush(true);
+      });
+  }
+
+  /* Print ADDR, with its name, once the name is in or the budget is spent. */
+  void print(uint32_t addr)
+  {
+    prefetch(addr);
+    queue_.push_back({ addr, Clock::now() + budget_ });
+    flush(false);
+  }
+
+  /* The name of ADDR, or "" if it isn't known (yet). */
+  std::string name(uint32_t addr)
+  {
+    prefetch(addr);
+    return names_[addr].name;
+  }
+
+  /* Run the EventLoop until every host given to print() is printed. */
+  void drain()
+  {
+    if (not queue_.empty())
+    {
+      draining_ = true;
+      loop_.run();
+      draining_ = false;
+    }
+    fflush(stdout);
+  }
+
+private:
+  struct Name
+  {
+    std::string name;           // "" if there is none
+    bool done = false;          // the lookup has finished
+  };
+
+  struct Line
+  {
+    uint32_t addr;
+    Clock::time_point deadline;
+  };
+
+  /* Print the lines at the front of the queue that are ready, and arrange
+     to be called again when the next one's time is up. */
+  void flush(bool from_loop)
+  {
+    auto now = Clock::now();
+    bool printed = false;
+    while (not queue_.empty())
+    {
+      Line const& line = queue_.front();
+      Name const& name = names_[line.addr];
+      if (not name.done and now < line.deadline)
+        break;
+      char buf[IPV4_MAXLEN + 256];
+      size_t n = format_ipv4(line.addr, buf);
+      if (not name.name.empty())
+      {
+        buf[n++] = ' ';
+        n += name.name.copy(buf + n, 253);
+      }
+      buf[n++] = '\n';
+      fwrite(buf, 1, n, stdout);
+      printed = true;
+      queue_.pop_front();
+    }
+    if (armed_)
+      loop_.cancel(timer_);
+    armed_ = not queue_.empty();
+    if (armed_)
+      timer_ = loop_.after(queue_.front().deadline - now,
+                           [this]() { armed_ = false; flush(true); });
+    if (printed and from_loop)
+      fflush(stdout);
+    if (draining_ and queue_.empty())
+      loop_.stop();
+  }
+
+  EventLoop& loop_;
+  Resolver& dns_;
+  Clock::duration budget_;
+  std::unordered_map<uint32_t, Name> names_;
+  std::deque<Line> queue_;
+  EventLoop::Timer timer_;
+  bool armed_ = false;
+  bool draining_ = false;
+};
+
+/* Fixed-size buffers, handed out and taken back instead of allocated for
+   each connection. */
+class BufferPool
+{
+public:
+  static size_t const SIZE = 4096;
+
+  char* get()
+  {
+    if (free_.empty())
+    {
+      all_.emplace_back(new char[SIZE]);
+      return all_.back().get();
+    }
+    char* buf = free_.back();
+    free_.pop_back();
+    return buf;
+  }
+
+  void put(char* buf)
+  {
+    free_.push_back(buf);
+  }
+
+private:
+  std::vector<std::unique_ptr<char[]>> all_;
+  std::vector<char*> free_;
+};
+
+/* An incremental parser for the head of an HTTP response: the status line
+   and the headers up to the empty line.  It works in place on the caller's
+   receive buffer, taking each line as it completes, and keeps the values of
+   the WANTED headers as offsets into that buffer rather than copies. */
+class HttpHead
+{
+public:
+  enum State { partial, complete, invalid };
+
+  struct Span
+  {
+    size_t begin = 0;
+    size_t size = 0;
+    bool found = false;
+  };
+
+  explicit HttpHead(std::vector<std::string> const& wanted)
+    : wanted_(wanted), values_(wanted.size())
+  {}
+
+  /* Start over on a new response. */
+  void reset()
+  {
+    scanned_ = 0;
+    status_ = 0;
+    for (auto& v : values_)
+      v = Span();
+  }
+
+  /* BUF holds the first N bytes of the response.  Parse the lines completed
+     since the last call. */
+  State parse(char const* buf, size_t n)
+  {
+    for (;;)
+    {
+      auto nl = static_cast<char const*>(
+        memchr(buf + scanned_, '\n', n - scanned_));
+      if (not nl)
+        return partial;
+      size_t begin = scanned_;
+      size_t end = nl - buf;
+      scanned_ = end + 1;
+      if (end > begin and buf[end - 1] == '\r')
+        --end;
+      char const* line = buf + begin;
+      size_t len = end - begin;
+      if (status_ == 0)
+      {
+        // "HTTP/1.x 200 OK"
+        if (len < 12 or memcmp(line, "HTTP/1.", 7) != 0 or line[8] != ' ' or
+            unsigned(line[9] - '0') >= 10 or unsigned(line[10] - '0') >= 10 or
+            unsigned(line[11] - '0') >= 10)
+          return invalid;
+        status_ = (line[9] - '0') * 100 + (line[10] - '0') * 10 +
+          (line[11] - '0');
+        continue;
+      }
+      if (len == 0)
+        return complete;
+      auto colon = static_cast<char const*>(memchr(line, ':', len));
+      if (not colon)
+        continue;
+      size_t name_len = colon - line;
+      for (size_t i = 0; i < wanted_.size(); ++i)
+      {
+        if (values_[i].found or wanted_[i].size() != name_len or
+            strncasecmp(line, wanted_[i].data(), name_len) != 0)
+          continue;
+        size_t b = colon + 1 - buf;
+        while (b < end and (buf[b] == ' ' or buf[b] == '\t'))
+          ++b;
+        size_t e = end;
+        while (e > b and (buf[e - 1] == ' ' or buf[e - 1] == '\t'))
+          --e;
+        values_[i].begin = b;
+        values_[i].size = e - b;
+        values_[i].found = true;
+      }
+    }
+  }
+
+  /* The status code, or 0 if the status line isn't in yet. */
+  int status() const { return status_; }
+
+  /* Where the value of the I'th wanted header is in the buffer. */
+  Span const& value(size_t i) const { return values_[i]; }
+
+private:
+  std::vector<std::string> const& wanted_;
+  std::vector<Span> values_;
+  size_t scanned_ = 0;
+  int status_ = 0;
+};
+
+/* Append the N bytes at P to LINE in double quotes, escaping quotes,
+   backslashes and anything unprintable. */
+void append_quoted(std::string& line, char const* p, size_t n)
+{
+  line += '"';
+  for (size_t k = 0; k < n; ++k)
+  {
+    unsigned char ch = p[k];
+    if (ch == '"' or ch == '\\')
+      (line += '\\') += ch;
+    else if (ch < ' ' or ch > '~')
+    {
+      char hex[5];
+      snprintf(hex, sizeof(hex), "\\x%02x", ch);
+      line += hex;
+    }
+    else
+      line += ch;
+  }
+  line += '"';
+}
+
+/* Connects to open hosts on the EventLoop and finds out what they serve.
+   For HTTP it sends a minimal HEAD (or GET) request and prints the status
+   and the chosen headers of the response; otherwise it prints the first
+   line the service sends by itself (its banner):
+
+     10.60.3.7:80 200 Server="nginx/1.24.0"
+     10.60.3.9:80 - not-http
+     10.60.3.4:22 banner="SSH-2.0-OpenSSH_9.6"
+
+   Only so many connections are open at once; the rest wait their turn.
+   Each connection reads into a buffer from a pool and parses the response
+   as it arrives, stopping at the end of the headers or of the first
+   line. */
+class ServiceProbe
+{
+public:
+  struct Http
+  {
+    std::string method = "HEAD";
+    std::string path = "/";
+    std::vector<std::string> headers{ "Server" };
+  };
+
+  /* Ask for an HTTP response if HTTP is not null, else for a banner.  Keep
+     at most MAX_CONNS connections open at once. */
+  ServiceProbe(EventLoop& loop, Clock::duration timeout, Http const* http,
+               size_t max_conns)
+    : loop_(loop), timeout_(timeout), is_http_(http != nullptr),
+      http_(http ? *http : Http()), max_conns_(max_conns)
+  {}
+
+  ~ServiceProbe()
+  {
+    for (auto& c : conns_)
+      if (c.fd != -1)
+      {
+        loop_.cancel(c.timer);
+        loop_.remove(c.fd);
+        close(c.fd);
+      }
+  }
+
+  ServiceProbe(ServiceProbe const&) = delete;
+  ServiceProbe& operator=(ServiceProbe const&) = delete;
+
+  /* Probe PORT on ADDR. */
+  void add(uint32_t addr, uint16_t port)
+  {
+    queue_.push_back({ addr, port });
+    pump();
+  }
+
+  /* Number of targets waiting or being probed. */
+  size_t backlog() const
+  {
+    return queue_.size() + active_;
+  }
+
+  /* Call ROOM whenever a probe finishes, so a producer can hand over
+     more. */
+  void on_room(std::function<void()> room)
+  {
+    room_ = std::move(room);
+  }
+
+  /* Run the EventLoop until every target given to add() is done. */
+  void drain()
+  {
+    if (backlog() != 0)
+    {
+      draining_ = true;
+      loop_.run();
+      draining_ = false;
+    }
+    fflush(stdout);
+  }
+
+  size_t max_conns() const { return max_conns_; }
+
+private:
+  struct Target
+  {
+    uint32_t addr;
+    uint16_t port;
+  };
+
+  struct Conn
+  {
+    Conn(std::vector<std::string> const& headers) : head(headers) {}
+
+    Target target{};
+    int fd = -1;
+    bool connected = false;
+    char* buf = nullptr;
+    size_t len = 0;
+    HttpHead head;
+    EventLoop::Timer timer;
+  };
+
+  /* Start connections while there is room. */
+  void pump()
+  {
+    while (not queue_.empty() and active_ < max_conns_)
+    {
+      Target t = queue_.front();
+      queue_.pop_front();
+      size_t i;
+      if (idle_.empty())
+      {
+        i = conns_.size();
+        conns_.emplace_back(http_.headers);
+      }
+      else
+      {
+        i = idle_.back();
+        idle_.pop_back();
+      }
+      Conn& c = conns_[i];
+      c.target = t;
+      c.connected = false;
+      c.len = 0;
+      c.head.reset();
+      c.fd = start_connect(t.addr, t.port);
+      if (c.fd == -1 and resource_shortage(errno))
+      {
+        // Wait for a connection to finish, or failing that a moment.
+        queue_.push_front(t);
+        idle_.push_back(i);
+        if (active_ == 0 and not retry_set_)
+        {
+          retry_set_ = true;
+          loop_.after(std::chrono::milliseconds(10), [this]() {
+              retry_set_ = false;
+              pump();
+            });
+        }
+        break;
+      }
+      if (c.fd == -1)
+      {
+        print(c, outcome_name(connect_outcome(errno)));
+        idle_.push_back(i);
+        continue;
+      }
+      ++active_;
+      c.buf = pool_.get();
+      loop_.add(c.fd, EPOLLOUT, [this, i](uint32_t events) {
+          on_event(i, events);
+        });
+      c.timer = loop_.after(timeout_, [this, i]() {
+          finish(i, "timeout", false);
+        });
+    }
+    if (draining_ and backlog() == 0)
+      loop_.stop();
+  }
+
+  void on_event(size_t i, uint32_t events)
+  {
+    Conn& c = conns_[i];
+    if (not c.connected)
+    {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+      if (err != 0 or events & (EPOLLERR | EPOLLHUP))
+      {
+        finish(i, outcome_name(err ? connect_outcome(err) : Outcome::refused));
+        return;
+      }
+      c.connected = true;
+      if (is_http_)
+      {
+        char host[IPV4_MAXLEN + 1];
+        host[format_ipv4(c.target.addr, host)] = '\0';
+        std::string request = http_.method + ' ' + http_.path +
+          " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: scanport\r\n"
+          "Accept: */*\r\nConnection: close\r\n\r\n";
+        // The request fits in an empty socket buffer.
+        if (send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+            ssize_t(request.size()))
+        {
+          finish(i, "closed");
+          return;
+        }
+      }
+      loop_.modify(c.fd, EPOLLIN | EPOLLRDHUP);
+      // The response gets a timeout of its own.
+      loop_.cancel(c.timer);
+      c.timer = loop_.after(timeout_, [this, i]() {
+          // Report an answer cut short by the timeout as far as it got.
+          finish(i, complete_enough(conns_[i]) ? nullptr : "timeout", false);
+        });
+      return;
+    }
+    for (;;)
+    {
+      ssize_t n = read(c.fd, c.buf + c.len, BufferPool::SIZE - c.len);
+      if (n == -1 and errno == EINTR)
+        continue;
+      if (n == -1 and errno == EAGAIN)
+        return;
+      if (n <= 0)
+      {
+        finish(i, complete_enough(c) ? nullptr : "closed");
+        return;
+      }
+      c.len += n;
+      if (not is_http_)
+      {
+        if (memchr(c.buf + c.len - n, '\n', n) or c.len == BufferPool::SIZE)
+        {
+          finish(i, nullptr);
+          return;
+        }
+        continue;
+      }
+      switch (c.head.parse(c.buf, c.len))
+      {
+      case HttpHead::complete:
+        finish(i, nullptr);
+        return;
+      case HttpHead::invalid:
+        finish(i, "not-http");
+        return;
+      case HttpHead::partial:
+        // A head too big for the buffer: report what we have.
+        if (c.len == BufferPool::SIZE)
+        {
+          finish(i, c.head.status() ? nullptr : "not-http");
+          return;
+        }
+        break;
+      }
+    }
+  }
+
+  /* Whether enough of the answer is in to report it. */
+  bool complete_enough(Conn const& c) const
+  {
+    return is_http_ ? c.head.status() != 0 : c.len != 0;
+  }
+
+  /* Print the result for connection I, or ERROR if not null, and free the
+     connection for the next target.  CANCEL is false when called from the
+     connection's own timer, which has fired already. */
+  void finish(size_t i, char const* error, bool cancel = true)
+  {
+    Conn& c = conns_[i];
+    if (cancel)
+      loop_.cancel(c.timer);
+    print(c, error);
+    loop_.remove(c.fd);
+    close(c.fd);
+    c.fd = -1;
+    pool_.put(c.buf);
+    c.buf = nullptr;
+    idle_.push_back(i);
+    --active_;
+    pump();
+    if (room_)
+      room_();
+  }
+
+  void print(Conn const& c, char const* error)
+  {
+    char addr[IPV4_MAXLEN + 1];
+    std::string line(addr, format_ipv4(c.target.addr, addr));
+    line += ':' + std::to_string(c.target.port) + ' ';
+    if (error)
+      (line += "- ") += error;
+    else if (not is_http_)
+    {
+      auto nl = static_cast<char const*>(memchr(c.buf, '\n', c.len));
+      size_t n = nl ? nl - c.buf : c.len;
+      if (n > 0 and c.buf[n - 1] == '\r')
+        --n;
+      line += "banner=";
+      append_quoted(line, c.buf, n);
+    }
+    else
+    {
+      line += std::to_string(c.head.status());
+      for (size_t h = 0; h < http_.headers.size(); ++h)
+      {
+        HttpHead::Span const& v = c.head.value(h);
+        if (not v.found)
+          continue;
+        line += ' ' + http_.headers[h] + '=';
+        append_quoted(line, c.buf + v.begin, v.size);
+      }
+    }
+    line += '\n';
+    fwrite(line.data(), 1, line.size(), stdout);
+    fflush(stdout);
+  }
+
+  EventLoop& loop_;
+  Clock::duration timeout_;
+  bool is_http_;
+  Http http_;
+  size_t max_conns_;
+  BufferPool pool_;
+  std::deque<Conn> conns_;
+  std::vector<size_t> idle_;
+  std::deque<Target> queue_;
+  size_t active_ = 0;
+  bool draining_ = false;
+  bool retry_set_ = false;
+  std::function<void()> room_;
+};
+
+/* Makes TCP sockets inside other network namespaces, given by the paths
+   of their namespace files (e.g. /run/netns/NAME or /proc/PID/ns/net), and
+   opens the sysctls a Throttle watches there.  A socket or sysctl file
+   stays in the namespace it was opened in, so once opened it can be used
+   from any thread.  Only a helper thread ever calls setns(), so the rest
+   of the process stays where it is.  Sockets are made a few at a time to
+   save round trips to the helper. */
+class NetnsSockets
+{
+public:
+  explicit NetnsSockets(std::vector<std::string> const& paths)
+    : spare_(paths.size())
+  {
+    for (auto& path : paths)
+    {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
+      {
+        for (int f : nsfds_)
+          close(f);
+        throw std::runtime_error("open " + path + ": " + errStr());
+      }
+      nsfds_.push_back(fd);
+    }
+    helper_ = std::thread([this]() { serve(); });
+  }
+
+  ~NetnsSockets()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    wake_.notify_all();
+    helper_.join();
+    for (auto& fds : spare_)
+      for (int fd : fds)
+        close(fd);
+    for (int fd : nsfds_)
+      close(fd);
+  }
+
+  NetnsSockets(NetnsSockets const&) = delete;
+  NetnsSockets& operator=(NetnsSockets const&) = delete;
+
+  /* A new non-blocking TCP socket in namespace NS, an index into the
+     paths, or -1 with errno set if none could be made. */
+  int make(size_t ns)
+  {
+    auto& spare = spare_[ns];
+    if (spare.empty())
+    {
+      int err = 0;
+      run_in(ns, [&]() {
+          for (size_t k = 0; k < BATCH; ++k)
+          {
+            int fd = tcp_socket();
+            if (fd == -1)
+            {
+              err = errno;
+              break;
+            }
+            spare.push_back(fd);
+          }
+        });
+      if (spare.empty())
+      {
+        errno = err;
+        return -1;
+      }
+    }
+    int fd = spare.back();
+    spare.pop_back();
+    return fd;
+  }
+
+  /* The limits of namespace NS, for its Throttle. */
+  NetLimits limits(size_t ns)
+  {
+    NetLimits limits;
+    run_in(ns, [&]() { limits = NetLimits::open(); });
+    return limits;
+  }
+
+private:
+  static size_t const BATCH = 16;
+
+  /* Run FN on the helper thread, inside namespace NS, and wait for it. */
+  void run_in(size_t ns, std::function<void()> const& fn)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    request_ = ns;
+    task_ = &fn;
+    wake_.notify_all();
+    wake_.wait(lock, [this]() { return task_ == nullptr; });
+    if (not error_.empty())
+    {
+      std::string error = std::move(error_);
+      error_.clear();
+      throw std::runtime_error(error);
+    }
+  }
+
+  void serve()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+      wake_.wait(lock, [this]() { return task_ or quit_; });
+      if (quit_)
+        return;
+      if (setns(nsfds_[request_], CLONE_NEWNET) == -1)
+        error_ = "setns: " + errStr();
+      else
+        (*task_)();
+      task_ = nullptr;
+      wake_.notify_all();
+    }
+  }
+
+  std::vector<int> nsfds_;
+  std::vector<std::vector<int>> spare_;   // made but not handed out, per ns
+  std::thread helper_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool quit_ = false;
+  size_t request_ = 0;
+  std::function<void()> const* task_ = nullptr;
+  std::string error_;           // setns() failed
+};
+
+/* Probes targets with non-blocking connects multiplexed on one EventLoop,
+   no threads.  Each target's socket comes from MAKE_SOCKET, so it may live
+   in another network namespace; it returns -1 with errno set if it can't
+   make one.  A target that finds no socket or port free waits its turn
+   again.  At most WINDOW connects are out at once, and the Throttle that
+   THROTTLE gives for a target, that of its namespace, can hold it back.
+   DONE gets each result as it comes.  Targets are IPv4 addresses and a
+   port, or any socket addresses MAKE_SOCKET's sockets can connect to.
+
+   With use_socks5(), each target is reached through a SOCKS5 proxy
+   instead, the proxies taking turns.  The greeting and the CONNECT request
+   go out together in one write as soon as the proxy accepts, and the
+   proxy's answer to the CONNECT is the result.  A proxy that can't be
+   reached or doesn't speak SOCKS5 without authentication is reported and
+   dropped, and its targets go to the others.  If none is left, the targets
+   not yet probed are counted unreachable and proxies_lost() says so. */
+class ConnectScanner
+{
+public:
+  using MakeSocket = std::function<int(size_t i)>;
+  using Done = std::function<void(size_t i, Probe const& probe)>;
+  using ThrottleFor = std::function<Throttle&(size_t i)>;
+  // Fills in the address of target I and returns its length.
+  using Address = std::function<socklen_t(size_t i, sockaddr_storage& sa)>;
+  // Target I, for messages.
+  using Name = std::function<std::string(size_t i)>;
+
+  struct Proxy
+  {
+    uint32_t addr;
+    uint16_t port;
+  };
+
+  ConnectScanner(EventLoop& loop, Clock::duration timeout, size_t window,
+                 ThrottleFor throttle, MakeSocket make_socket, Done done)
+    : loop_(loop), timeout_(timeout), window_(window),
+      throttle_(std::move(throttle)),
+      make_socket_(std::move(make_socket)), done_(std::move(done))
+  {}
+
+  ConnectScanner(ConnectScanner const&) = delete;
+  ConnectScanner& operator=(ConnectScanner const&) = delete;
+
+  void use_socks5(std::vector<Proxy> proxies)
+  {
+    proxies_ = std::move(proxies);
+    alive_.assign(proxies_.size(), true);
+    live_ = proxies_.size();
+  }
+
+  /* Probe PORT on each of ADDRS, and return when all are done. */
+  void run(std::vector<uint32_t> const& addrs, uint16_t port)
+  {
+    run(addrs.size(),
+        [&addrs, port](size_t i, sockaddr_storage& sa) -> socklen_t {
+          auto& sin = reinterpret_cast<sockaddr_in&>(sa);
+          sin = sockaddr_in{};
+          sin.sin_family = AF_INET;
+          sin.sin_port = htons(port);
+          sin.sin_addr.s_addr = htonl(addrs[i]);
+          return sizeof(sin);
+        },
+        [&addrs](size_t i) { return ipv4_string(addrs[i]); });
+  }
+
+  /* Probe COUNT targets, the Ith at ADDRESS(i), and return when all are
+     done. */
+  void run(size_t count, Address address, Name name)
+  {
+    count_ = count;
+    address_ = std::move(address);
+    name_ = std::move(name);
+    next_ = 0;
+    left_ = count;
+    if (left_ == 0)
+      return;
+    pump();
+    if (left_ != 0)
+      loop_.run();
+  }
+
+  /* Whether use_socks5() was given proxies and all of them failed. */
+  bool proxies_lost() const
+  {
+    return not proxies_.empty() and live_ == 0;
+  }
+
+private:
+  struct Conn
+  {
+    size_t i;
+    int fd;
+    Clock::time_point start;
+    EventLoop::Timer timer;
+    size_t proxy;
+    Throttle* throttle;
+    bool requested = false;     // the SOCKS5 request has been sent
+    size_t got = 0;
+    unsigned char reply[4];     // method choice, then VER and REP
+  };
+
+  /* Start connects while there is room. */
+  void pump()
+  {
+    while ((next_ < count_ or not retry_.empty()) and
+           conns_.size() < window_)
+    {
+      if (proxies_lost())
+      {
+        size_t i = retry_.empty() ? next_++ : retry_.back();
+        if (not retry_.empty())
+          retry_.pop_back();
+        finish(i, Probe{ Outcome::unreachable, {} });
+        continue;
+      }
+      size_t i = retry_.empty() ? next_ : retry_.back();
+      Throttle& throttle = throttle_(i);
+      if (not throttle.admit(in_flight_[&throttle]))
+      {
+        pump_later();
+        return;
+      }
+      if (retry_.empty())
+        ++next_;
+      else
+        retry_.pop_back();
+      sockaddr_storage sa;
+      socklen_t len = address_(i, sa);
+      auto start = Clock::now();
+      size_t proxy = 0;
+      int fd = make_socket_(i);
+      bool made = fd != -1;
+      if (made and proxies_.empty())
+        fd = start_connect(fd, (sockaddr*) &sa, len);
+      else if (made)
+      {
+        proxy = next_proxy();
+        fd = start_connect(proxies_[proxy].addr, proxies_[proxy].port, fd);
+      }
+      if (fd == -1 and resource_shortage(errno))
+      {
+        if (debug)
+          std::clog << name_(i) + " - " + errStr() + "\n";
+        throttle.cancel();
+        retry_.push_back(i);
+        pump_later();
+        return;
+      }
+      if (fd == -1 and not made)
+        throw std::runtime_error("socket: " + errStr());
+      if (fd == -1 and not proxies_.empty())
+      {
+        drop_proxy(proxy, errStr(), i);
+        continue;
+      }
+      if (fd == -1)
+      {
+        if (debug)
+          std::clog << name_(i) + " - " + errStr() + "\n";
+        finish(i, Probe{ connect_outcome(errno), Clock::now() - start });
+        continue;
+      }
+      Conn& c = conns_[fd];
+      c.i = i;
+      c.fd = fd;
+      c.start = start;
+      c.proxy = proxy;
+      c.throttle = &throttle;
+      ++in_flight_[&throttle];
+      loop_.add(fd, EPOLLOUT, [this, fd](uint32_t) { on_ready(fd); });
+      c.timer = loop_.after(timeout_, [this, fd]() {
+          Conn c = conns_[fd];
+          if (debug)
+            std::clog << name_(c.i) + " - timeout\n";
+          close_conn(fd);
+          finish(c.i, Probe{ Outcome::timeout, {} });
+          pump();
+        });
+    }
+  }
+
+  /* Call pump() again in a moment, unless a connection in flight will
+     call it sooner. */
+  void pump_later()
+  {
+    if (conns_.empty() and not retry_set_)
+    {
+      retry_set_ = true;
+      loop_.after(std::chrono::milliseconds(10), [this]() {
+          retry_set_ = false;
+          pump();
+        });
+    }
+  }
+
+  void on_ready(int fd)
+  {
+    if (proxies_.empty())
+      on_connected(fd);
+    else if (not conns_[fd].requested)
+      send_request(fd);
+    else
+      on_reply(fd);
+  }
+
+  void on_connected(int fd)
+  {
+    Conn c = conns_[fd];
+    loop_.cancel(c.timer);
+    auto latency = Clock::now() - c.start;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+      err = errno;
+    if (err == 0)
+      latency = handshake_rtt(fd, latency);
+    if (debug)
+      std::clog << name_(c.i) + " - " +
+        (err ? std::string("not connected: ") + strerror(err)
+         : std::string("connected")) + "\n";
+    close_conn(fd);
+    finish(c.i, Probe{ connect_outcome(err), latency });
+    pump();
+  }
+
+  /* Connected to the proxy: send the greeting, offering no authentication,
+     and the CONNECT request in one go. */
+  void send_request(int fd)
+  {
+    Conn& c = conns_[fd];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+      err = errno;
+    if (err == 0)
+    {
+      sockaddr_storage sa;
+      address_(c.i, sa);
+      unsigned char req[25] = { 5, 1, 0,        // version, 1 method: none
+                                5, 1, 0 };      // CONNECT
+      size_t size;
+      if (sa.ss_family == AF_INET6)
+      {
+        auto& sin6 = reinterpret_cast<sockaddr_in6&>(sa);
+        req[6] = 4;                             // to an IPv6 address
+        memcpy(req + 7, &sin6.sin6_addr, 16);
+        memcpy(req + 23, &sin6.sin6_port, 2);
+        size = 25;
+      }
+      else
+      {
+        auto& sin = reinterpret_cast<sockaddr_in&>(sa);
+        req[6] = 1;                             // to an IPv4 address
+        memcpy(req + 7, &sin.sin_addr, 4);
+        memcpy(req + 11, &sin.sin_port, 2);
+        size = 13;
+      }
+      ssize_t n = send(fd, req, size, MSG_NOSIGNAL);
+      if (n == ssize_t(size))
+      {
+        c.requested = true;
+        loop_.modify(fd, EPOLLIN);
+        return;
+      }
+      err = n == -1 ? errno : EPIPE;
+    }
+    proxy_failed(fd, strerror(err));
+  }
+
+  void on_reply(int fd)
+  {
+    Conn& c = conns_[fd];
+    ssize_t n = recv(fd, c.reply + c.got, sizeof(c.reply) - c.got, 0);
+    if (n == -1 and (errno == EAGAIN or errno == EINTR))
+      return;
+    if (n <= 0)
+    {
+      proxy_failed(fd, n == 0 ? "Connection closed" : errStr());
+      return;
+    }
+    c.got += n;
+    if (c.got >= 2 and (c.reply[0] != 5 or c.reply[1] != 0))
+    {
+      proxy_failed(fd, "Not a SOCKS5 proxy without authentication");
+      return;
+    }
+    if (c.got < sizeof(c.reply))
+      return;
+    if (c.reply[2] != 5)
+    {
+      proxy_failed(fd, "Invalid SOCKS5 reply");
+      return;
+    }
+    // The rest of the reply, the address the proxy bound, isn't needed.
+    Outcome outcome;
+    switch (c.reply[3])
+    {
+    case 0:
+      outcome = Outcome::open;
+      break;
+    case 5:                     // connection refused
+      outcome = Outcome::refused;
+      break;
+    case 6:                     // TTL expired
+      outcome = Outcome::timeout;
+      break;
+    case 7:                     // command not supported
+    case 8:                     // address type not supported
+      proxy_failed(fd, "SOCKS5 error " + std::to_string(c.reply[3]));
+      return;
+    default:                    // general failure, not allowed by ruleset,
+      outcome = Outcome::unreachable; // network or host unreachable
+      break;
+    }
+    size_t i = c.i;
+    auto latency = Clock::now() - c.start;
+    if (debug)
+      std::clog << name_(i) + " - SOCKS5 reply " +
+        std::to_string(c.reply[3]) + "\n";
+    loop_.cancel(c.timer);
+    close_conn(fd);
+    finish(i, Probe{ outcome, latency });
+    pump();
+  }
+
+  /* The proxy of the probe on FD failed with ERROR: drop the proxy and try
+     the target again through another. */
+  void proxy_failed(int fd, std::string const& error)
+  {
+    Conn c = conns_[fd];
+    loop_.cancel(c.timer);
+    close_conn(fd);
+    drop_proxy(c.proxy, error, c.i);
+    pump();
+  }
+
+  void drop_proxy(size_t proxy, std::string const& error, size_t i)
+  {
+    if (alive_[proxy])
+    {
+      alive_[proxy] = false;
+      --live_;
+      fflush(stdout);
+      std::clog << program_name << ": proxy "
+                << ipv4_string(proxies_[proxy].addr) << ':'
+                << proxies_[proxy].port << ": " << error << std::endl;
+    }
+    if (live_ == 0)
+      finish(i, Probe{ Outcome::unreachable, {} });
+    else
+      retry_.push_back(i);
+  }
+
+  size_t next_proxy()
+  {
+    while (not alive_[turn_ % proxies_.size()])
+      ++turn_;
+    return turn_++ % proxies_.size();
+  }
+
+  void close_conn(int fd)
+  {
+    loop_.remove(fd);
+    close(fd);
+    --in_flight_[conns_[fd].throttle];
+    conns_.erase(fd);
+  }
+
+  void finish(size_t i, Probe const& probe)
+  {
+    done_(i, probe);
+    if (--left_ == 0)
+      loop_.stop();
+  }
+
+  EventLoop& loop_;
+  Clock::duration timeout_;
+  size_t window_;
+  ThrottleFor throttle_;
+  MakeSocket make_socket_;
+  Done done_;
+  size_t count_ = 0;
+  Address address_;
+  Name name_;
+  size_t next_ = 0;
+  size_t left_ = 0;
+  std::unordered_map<int, Conn> conns_;
+  std::unordered_map<Throttle*, size_t> in_flight_;
+  bool retry_set_ = false;
+  std::vector<Proxy> proxies_;
+  std::vector<bool> alive_;
+  size_t live_ = 0;
+  size_t turn_ = 0;
+  std::vector<size_t> retry_;   // targets to try again
+};
+
+/* Expand the scan targets into addresses, in order.  A target is a /24
+   subnet, "x.x.x.0/24", which stands for its 254 hosts; an address; or a
+   host name, which stands for all its IPv4 addresses.  Names are all looked
+   up at once through DNS on LOOP; those that don't resolve are reported and
+   skipped.  If ORIGIN is not null, it gets the index in TARGETS of the
+   target each address came from. */
+std::vector<uint32_t> expand_targets(std::vector<std::string> const& targets,
+                                     EventLoop& loop, Resolver& dns,
+                                     std::vector<size_t>* origin = nullptr)
+{
+  std::vector<std::vector<uint32_t>> expanded(targets.size());
+  bool waiting = false;
+  for (size_t i = 0; i < targets.size(); ++i)
+  {
+    std::string const& target = targets[i];
+    char const* p = target.c_str();
+    char const* end = p + target.size();
+    uint32_t addr;
+    if (parse_ipv4(p, end, addr))
+    {
+      if (p == end)
+        expanded[i].push_back(addr);
+      else if (strcmp(p, "/24") == 0)
+        for (uint32_t h = 1; h < 255; ++h)
+          expanded[i].push_back((addr & 0xffffff00) | h); // e.g., 10.60.3.h
+      else
+        throw std::runtime_error("Invalid subnet '" + target + '\'');
+      continue;
+    }
+    if (target.empty() or target.find_first_not_of(
+          "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_")
+        != std::string::npos)
+      throw std::runtime_error("Invalid target '" + target + '\'');
+    std::string name = target;
+    if (name.back() == '.')
+      name.pop_back();
+    dns.resolve(name, [&, i](std::vector<uint32_t> const& a) {
+        if (a.empty())
+        {
+          fflush(stdout);
+          std::clog << program_name << ": " << targets[i]
+                    << ": No IPv4 address found" << std::endl;
+        }
+        expanded[i] = a;
+        // Stop as soon as the last answer is in.
+        if (waiting and dns.pending() == 0)
+          loop.stop();
+      });
+  }
+  waiting = true;
+  if (dns.pending() != 0)
+    loop.run();
+
+  std::vector<uint32_t> addrs;
+  for (size_t i = 0; i < expanded.size(); ++i)
+  {
+    addrs.insert(addrs.end(), expanded[i].begin(), expanded[i].end());
+    if (origin)
+      origin->resize(addrs.size(), i);
+  }
+  return addrs;
+}
+
+/* Sort KEYS, whose values fit in the low BITS bits, with an LSD radix sort
+   taking 16 bits per pass.  Passes where every key has the same digit are
+   skipped.  Large inputs are counted and scattered by several threads, each
+   owning a contiguous slice so the sort stays stable. */
+void radix_sort(std::vector<uint64_t>& keys, int bits)
+{
+  size_t const n = keys.size();
+  size_t const RADIX = 1 << 16;
+  size_t nthreads = 1;
+  if (n >= (1 << 20))
+    nthreads = std::max(1u, std::min(std::thread::hardware_concurrency(), 16u));
+  size_t const slice = (n + nthreads - 1) / nthreads;
+
+  std::vector<uint64_t> tmp(n);
+  std::vector<size_t> counts(nthreads * RADIX);
+
+  auto parallel = [&](std::function<void(size_t, size_t, size_t)> fn) {
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nthreads; ++t)
+      threads.emplace_back(fn, t, std::min(n, t * slice),
+                           std::min(n, (t + 1) * slice));
+    fn(0, 0, std::min(n, slice));
+    for (auto& th : threads)
+      th.join();
+  };
+
+  for (int shift = 0; shift < bits; shift += 16)
+  {
+    std::fill(counts.begin(), counts.end(), 0);
+    parallel([&](size_t t, size_t begin, size_t end) {
+        size_t* c = &counts[t * RADIX];
+        for (size_t i = begin; i < end; ++i)
+          ++c[(keys[i] >> shift) & (RADIX - 1)];
+      });
+
+    // Turn counts into starting offsets, digit-major then thread-minor.
+    size_t total = 0;
+    bool trivial = false;
+    for (size_t d = 0; d < RADIX; ++d)
+    {
+      size_t digit_total = 0;
+      for (size_t t = 0; t < nthreads; ++t)
+      {
+        size_t c = counts[t * RADIX + d];
+        counts[t * RADIX + d] = total;
+        total += c;
+        digit_total += c;
+      }
+      if (digit_total == n)
+        trivial = true;
+    }
+    if (trivial)
+      continue;
+
+    parallel([&](size_t t, size_t begin, size_t end) {
+        size_t* c = &counts[t * RADIX];
+        for (size_t i = begin; i < end; ++i)
+          tmp[c[(keys[i] >> shift) & (RADIX - 1)]++] = keys[i];
+      });
+    keys.swap(tmp);
+  }
+}
+
+/* Write a result key to stdout as "ADDR" or, if it has a port, "ADDR:PORT". */
+void print_result(uint64_t key)
+{
+  char buf[IPV4_MAXLEN + 8];
+  size_t n = format_ipv4(key >> 16, buf);
+  if (uint16_t port = key & 0xffff)
+    n += snprintf(buf + n, sizeof(buf) - n, ":%u", port);
+  buf[n++] = '\n';
+  fwrite(buf, 1, n, stdout);
+}
+
+/* A read-only memory mapping of a whole file. */
+class MappedFile
+{
+public:
+  explicit MappedFile(std::string const& path)
+    : path_(path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      throw std::runtime_error("open " + path + ": " + errStr());
+    std::shared_ptr<void> finally{ nullptr, [fd](void*) { close(fd); } };
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+      throw std::runtime_error("fstat " + path + ": " + errStr());
+    size_ = st.st_size;
+    if (size_ == 0)
+      return;
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data_ == MAP_FAILED)
+      throw std::runtime_error("mmap " + path + ": " + errStr());
+    madvise(data_, size_, MADV_SEQUENTIAL);
+  }
+
+  ~MappedFile()
+  {
+    if (size_ != 0)
+      munmap(data_, size_);
+  }
+
+  MappedFile(MappedFile const&) = delete;
+  MappedFile& operator=(MappedFile const&) = delete;
+
+  std::string const& path() const { return path_; }
+  char const* begin() const { return static_cast<char const*>(data_); }
+  char const* end() const { return begin() + size_; }
+
+private:
+  std::string path_;
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/* Reads result keys, one "ADDR" or "ADDR:PORT" per line, from a text file
+   such as the output of a scan.  Blank lines are skipped. */
+class ResultReader
+{
+public:
+  explicit ResultReader(std::string const& path)
+    : file_(path), p_(file_.begin())
+  {}
+
+  /* Read the next key into KEY.  Returns false at end of file. */
+  bool next(uint64_t& key)
+  {
+    char const* end = file_.end();
+    while (p_ != end and (*p_ == '\n' or *p_ == '\r'))
+    {
+      line_ += *p_ == '\n';
+      ++p_;
+    }
+    if (p_ == end)
+      return false;
+    uint32_t addr;
+    unsigned port = 0;
+    if (not parse_ipv4(p_, end, addr))
+      bad();
+    if (p_ != end and *p_ == ':')
+    {
+      char const* digits = ++p_;
+      while (p_ != end and unsigned(*p_ - '0') < 10 and port <= 0xffff)
+        port = port * 10 + (*p_++ - '0');
+      if (p_ == digits or port > 0xffff)
+        bad();
+    }
+    if (p_ != end and *p_ == '\r')
+      ++p_;
+    if (p_ != end and *p_ != '\n')
+      bad();
+    key = result_key(addr, port);
+    return true;
+  }
+
+  [[noreturn]] void bad() const
+  {
+    throw std::runtime_error(file_.path() + ":" + std::to_string(line_ + 1) +
+                             ": Invalid result line");
+  }
+
+  [[noreturn]] void unsorted() const
+  {
+    throw std::runtime_error(file_.path() + ":" + std::to_string(line_ + 1) +
+                             ": Results are not sorted");
+  }
+
+private:
+  MappedFile file_;
+  char const* p_;
+  size_t line_ = 0;
+};
+
+/* Merge the sorted result files at PATHS, calling EMIT for each distinct key
+   in ascending order.  The inputs are mapped and merged through a heap
+   holding one key per file, so memory use does not depend on the size of the
+   inputs. */
+void merge_results(std::vector<std::string> const& paths,
+                   std::function<void(uint64_t)> const& emit)
+{
+  std::vector<std::unique_ptr<ResultReader>> readers;
+  for (auto& path : paths)
+    readers.emplace_back(new ResultReader(path));
+
+  using Entry = std::pair<uint64_t, size_t>; // key, reader
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+  uint64_t key;
+  for (size_t i = 0; i < readers.size(); ++i)
+    if (readers[i]->next(key))
+      heap.emplace(key, i);
+
+  bool any = false;
+  uint64_t last = 0;
+  while (not heap.empty())
+  {
+    Entry top = heap.top();
+    heap.pop();
+    if (not any or top.first != last)
+      emit(top.first);
+    any = true;
+    last = top.first;
+    if (readers[top.second]->next(key))
+    {
+      if (key < top.first)
+        readers[top.second]->unsorted();
+      heap.emplace(key, top.second);
+    }
+  }
+}
+
+/* scanport merge FILES...
+
+   Merge sorted result files, such as the output of several scans with
+   --sorted, into one sorted list without duplicates. */
+int merge_main(int argc, char** argv)
+{
+  merge_results(std::vector<std::string>(argv, argv + argc), print_result);
+  return 0;
+}
+
+/* Compressed snapshot of a sorted set of result keys.
+
+   Layout, all integers little-endian:
+
+     char     magic[8]          "SCANSNP1"
+     uint64   count             number of keys
+     uint64   nblocks
+     struct { uint64 first; uint64 offset; } index[nblocks]
+     uint8    data[]
+
+   Keys are grouped in blocks of SNAPSHOT_BLOCK.  The index holds each
+   block's first key and the offset of the rest of the block in data[], where
+   they are stored as LEB128 varint deltas from the previous key.  Lookups
+   binary search the index and decode at most one block, and the set
+   operations below walk the compressed form directly, skipping whole blocks
+   through the index. */
+
+char const SNAPSHOT_MAGIC[8] = { 'S', 'C', 'A', 'N', 'S', 'N', 'P', '1' };
+size_t const SNAPSHOT_BLOCK = 128;
+
+struct SnapshotIndex
+{
+  uint64_t first;
+  uint64_t offset;
+};
+
+class SnapshotWriter
+{
+public:
+  explicit SnapshotWriter(std::string const& path)
+    : path_(path)
+  {}
+
+  /* Append KEY, which must be greater than the previous key. */
+  void add(uint64_t key)
+  {
+    if (count_ != 0 and key <= last_)
+      throw std::runtime_error(path_ + ": Snapshot keys must be ascending");
+    if (count_ % SNAPSHOT_BLOCK == 0)
+      index_.push_back({ key, data_.size() });
+    else
+      for (uint64_t delta = key - last_;; delta >>= 7)
+      {
+        if (delta < 0x80)
+        {
+          data_.push_back(delta);
+          break;
+        }
+        data_.push_back((delta & 0x7f) | 0x80);
+      }
+    last_ = key;
+    ++count_;
+  }
+
+  void finish()
+  {
+    FILE* f = fopen(path_.c_str(), "wb");
+    if (not f)
+      throw std::runtime_error("fopen " + path_ + ": " + errStr());
+    std::shared_ptr<FILE> finally{ f, fclose };
+    uint64_t header[] = { htole64(count_), htole64(index_.size()) };
+    for (auto& i : index_)
+    {
+      i.first = htole64(i.first);
+      i.offset = htole64(i.offset);
+    }
+    if (fwrite(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), 1, f) != 1 or
+        fwrite(header, sizeof(header), 1, f) != 1 or
+        fwrite(index_.data(), sizeof(SnapshotIndex), index_.size(), f) !=
+        index_.size() or
+        fwrite(data_.data(), 1, data_.size(), f) != data_.size() or
+        fflush(f) != 0)
+      throw std::runtime_error("write " + path_ + ": " + errStr());
+  }
+
+private:
+  std::string path_;
+  std::vector<SnapshotIndex> index_;
+  std::string data_;
+  uint64_t count_ = 0;
+  uint64_t last_ = 0;
+};
+
+class Snapshot
+{
+public:
+  explicit Snapshot(std::string const& path)
+    : file_(path)
+  {
+    size_t size = file_.end() - file_.begin();
+    uint64_t header[2];
+    if (size < sizeof(SNAPSHOT_MAGIC) + sizeof(header) or
+        memcmp(file_.begin(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+      bad();
+    memcpy(header, file_.begin() + sizeof(SNAPSHOT_MAGIC), sizeof(header));
+    count_ = le64toh(header[0]);
+    nblocks_ = le64toh(header[1]);
+    char const* p = file_.begin() + sizeof(SNAPSHOT_MAGIC) + sizeof(header);
+    if (nblocks_ != (count_ + SNAPSHOT_BLOCK - 1) / SNAPSHOT_BLOCK or
+        uint64_t(file_.end() - p) / sizeof(SnapshotIndex) < nblocks_)
+      bad();
+    index_ = reinterpret_cast<SnapshotIndex const*>(p);
+    data_ = p + nblocks_ * sizeof(SnapshotIndex);
+    for (size_t b = 0; b < nblocks_; ++b)
+      if (offset(b) > uint64_t(file_.end() - data_))
+        bad();
+  }
+
+  uint64_t size() const { return count_; }
+
+  [[noreturn]] void bad() const
+  {
+    throw std::runtime_error(file_.path() + ": Invalid snapshot");
+  }
+
+  /* Iterates over the keys in order without decoding more than it must. */
+  class Cursor
+  {
+  public:
+    explicit Cursor(Snapshot const& snap)
+      : snap_(snap)
+    {
+      load(0);
+    }
+
+    bool done() const { return block_ >= snap_.nblocks_; }
+    uint64_t key() const { return key_; }
+
+    void next()
+    {
+      if (left_ == 0)
+      {
+        load(block_ + 1);
+        return;
+      }
+      uint64_t delta = 0;
+      for (int shift = 0;; shift += 7)
+      {
+        if (p_ == snap_.file_.end() or shift > 63)
+          snap_.bad();
+        uint8_t byte = *p_++;
+        delta |= uint64_t(byte & 0x7f) << shift;
+        if (byte < 0x80)
+          break;
+      }
+      key_ += delta;
+      --left_;
+    }
+
+    /* Advance to the first key not less than TARGET. */
+    void seek(uint64_t target)
+    {
+      if (done() or key_ >= target)
+        return;
+      // Jump to the last block starting at or before TARGET.
+      auto begin = snap_.index_ + block_ + 1;
+      auto end = snap_.index_ + snap_.nblocks_;
+      auto it = std::upper_bound(begin, end, target,
+                                 [](uint64_t t, SnapshotIndex const& i) {
+                                   return t < le64toh(i.first);
+                                 });
+      if (it != begin)
+        load(it - 1 - snap_.index_);
+      while (not done() and key_ < target)
+        next();
+    }
+
+  private:
+    void load(size_t block)
+    {
+      block_ = block;
+      if (done())
+        return;
+      key_ = snap_.first(block);
+      p_ = snap_.data_ + snap_.offset(block);
+      left_ = std::min<uint64_t>(SNAPSHOT_BLOCK,
+                                 snap_.count_ - block * SNAPSHOT_BLOCK) - 1;
+    }
+
+    Snapshot const& snap_;
+    size_t block_ = 0;
+    uint64_t key_ = 0;
+    char const* p_ = nullptr;
+    uint64_t left_ = 0;
+  };
+
+  bool contains(uint64_t key) const
+  {
+    Cursor c(*this);
+    c.seek(key);
+    return not c.done() and c.key() == key;
+  }
+
+private:
+  /* The first key of block B, and the offset of the rest in data_. */
+  uint64_t first(size_t b) const { return le64toh(index_[b].first); }
+  uint64_t offset(size_t b) const { return le64toh(index_[b].offset); }
+
+  MappedFile file_;
+  uint64_t count_ = 0;
+  uint64_t nblocks_ = 0;
+  SnapshotIndex const* index_ = nullptr;
+  char const* data_ = nullptr;
+};
+
+/* Parse "ADDR" or "ADDR:PORT" into a result key. */
+uint64_t parse_result(std::string const& s)
+{
+  char const* p = s.c_str();
+  char const* end = p + s.size();
+  uint32_t addr;
+  unsigned long port = 0;
+  if (parse_ipv4(p, end, addr))
+  {
+    if (p == end)
+      return result_key(addr, 0);
+    if (*p == ':' and unsigned(p[1] - '0') < 10)
+    {
+      char* e;
+      port = strtoul(p + 1, &e, 10);
+      if (e == end and port <= 0xffff)
+        return result_key(addr, port);
+    }
+  }
+  throw std::invalid_argument("Invalid result '" + s + '\'');
+}
+
+/* Add the proxies in the --proxy list SPEC, "socks5://ADDR[:PORT],...",
+   to PROXIES.  PORT defaults to 1080. */
+void parse_proxies(std::string const& spec,
+                   std::vector<ConnectScanner::Proxy>& proxies)
+{
+  for (size_t b = 0; b <= spec.size();)
+  {
+    size_t comma = std::min(spec.find(',', b), spec.size());
+    std::string proxy = spec.substr(b, comma - b);
+    b = comma + 1;
+    if (proxy.compare(0, 9, "socks5://") != 0)
+      throw std::runtime_error("Invalid proxy '" + proxy + '\'');
+    uint64_t key = parse_result(proxy.substr(9));
+    uint16_t port = key & 0xffff;
+    proxies.push_back(ConnectScanner::Proxy{ uint32_t(key >> 16),
+                                             port ? port : uint16_t(1080) });
+  }
+}
+
+/* scanport snapshot create OUT FILES...
+   scanport snapshot dump SNAP
+   scanport snapshot query SNAP ADDR[:PORT]...
+   scanport snapshot and SNAP1 SNAP2
+   scanport snapshot diff SNAP1 SNAP2
+
+   Build a compressed snapshot from sorted result files, print it, look up
+   results in it, or print the intersection of two snapshots or the results
+   in the first but not the second. */
+int snapshot_main(int argc, char** argv)
+{
+  std::string cmd = argc > 0 ? argv[0] : "";
+  if (cmd == "create" and argc >= 2)
+  {
+    SnapshotWriter w(argv[1]);
+    merge_results(std::vector<std::string>(argv + 2, argv + argc),
+                  [&w](uint64_t key) { w.add(key); });
+    w.finish();
+    return 0;
+  }
+  if (cmd == "dump" and argc == 2)
+  {
+    Snapshot snap(argv[1]);
+    for (Snapshot::Cursor c(snap); not c.done(); c.next())
+      print_result(c.key());
+    return 0;
+  }
+  if (cmd == "query" and argc >= 2)
+  {
+    Snapshot snap(argv[1]);
+    int status = 0;
+    for (int i = 2; i < argc; ++i)
+    {
+      bool found = snap.contains(parse_result(argv[i]));
+      printf("%s %s\n", argv[i], found ? "yes" : "no");
+      if (not found)
+        status = 1;
+    }
+    return status;
+  }
+  if ((cmd == "and" or cmd == "diff") and argc == 3)
+  {
+    bool const keep_common = cmd == "and";
+    Snapshot a(argv[1]), b(argv[2]);
+    Snapshot::Cursor ca(a), cb(b);
+    while (not ca.done())
+    {
+      cb.seek(ca.key());
+      bool common = not cb.done() and cb.key() == ca.key();
+      if (common == keep_common)
+        print_result(ca.key());
+      if (keep_common)
+      {
+        if (cb.done())
+          break;
+        ca.seek(cb.key() + common);
+      }
+      else
+        ca.next();
+    }
+    return 0;
+  }
+  throw std::runtime_error("wrong usage");
+}
+
+template <typename T>
+T string_to(std::string const&);
+
+/* Convert a decimal number of seconds, like "0.0003", into a duration.  The
+   digits are taken exactly, down to the nanosecond, rather than going
+   through floating point. */
+template <>
+Clock::duration string_to(std::string const& s)
+{
+  char const* p = s.c_str();
+  int64_t sec = 0;
+  int64_t ns = 0;
+  bool digits = false;
+  for (; unsigned(*p - '0') < 10; ++p, digits = true)
+  {
+    sec = sec * 10 + (*p - '0');
+    if (sec > 1000000000)
+      break;
+  }
+  if (*p == '.')
+  {
+    int64_t scale = 100000000;
+    for (++p; unsigned(*p - '0') < 10; ++p, digits = true, scale /= 10)
+      ns += (*p - '0') * scale;
+  }
+  if (not digits or *p != '\0')
+    throw std::invalid_argument("Invalid number of seconds '" + s + '\'');
+  return std::chrono::seconds(sec) + std::chrono::nanoseconds(ns);
+}
+
+template <>
+uint16_t string_to(std::string const& s)
+{
+  try
+  {
+    size_t idx;
+    auto v = std::stoul(s, &idx);
+    uint16_t r = v;
+    if (r == v and idx == s.size())
+      return r;
+  }
+  catch (std::exception&)
+  {}
+  throw std::invalid_argument("Invalid integer '" + s + '\'');
+}
+
+template <>
+uint32_t string_to(std::string const& s)
+{
+  try
+  {
+    size_t idx;
+    auto v = std::stoul(s, &idx);
+    uint32_t r = v;
+    if (r == v and idx == s.size())
+      return r;
+  }
+  catch (std::exception&)
+  {}
+  throw std::invalid_argument("Invalid integer '" + s + '\'');
+}
+
+/* The resolver to use: SPEC ("ADDR" or "ADDR:PORT") if not null, else the
+   first nameserver in /etc/resolv.conf, else 127.0.0.1. */
+sockaddr_in resolver_address(char const* spec)
+{
+  sockaddr_in sa{};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(53);
+  uint32_t addr = INADDR_LOOPBACK;
+  if (spec)
+  {
+    char const* p = spec;
+    char const* end = p + strlen(p);
+    if (not parse_ipv4(p, end, addr))
+      throw std::runtime_error("Invalid resolver '" + std::string(spec) + '\'');
+    if (*p == ':')
+      sa.sin_port = htons(string_to<uint16_t>(p + 1));
+    else if (p != end)
+      throw std::runtime_error("Invalid resolver '" + std::string(spec) + '\'');
+  }
+  else if (FILE* f = fopen("/etc/resolv.conf", "r"))
+  {
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+      char const* p = line;
+      if (strncmp(p, "nameserver", 10) != 0)
+        continue;
+      for (p += 10; *p == ' ' or *p == '\t'; ++p)
+      {}
+      uint32_t a;
+      if (parse_ipv4(p, p + strlen(p), a))
+      {
+        addr = a;
+        break;
+      }
+    }
+    fclose(f);
+  }
+  sa.sin_addr.s_addr = htonl(addr);
+  return sa;
+}
+
+/* How much of the machine scanport may use, from RLIMIT_NOFILE and, inside
+   a container, the cgroup v2 limits of its cgroup and the ones above it,
+   and what the scan is sized to so that it fits. */
+struct Resources
+{
+  static uint64_t const UNLIMITED = UINT64_MAX;
+  // Estimated memory for each probing thread: its stack and socket.
+  static size_t const THREAD_MEMORY = 256 << 10;
+  static size_t const THREAD_STACK = 128 << 10;
+  // File descriptors kept for the main thread, the event loop, the
+  // resolver, the ring and so on.
+  static uint64_t const RESERVED_FDS = 64;
+  // --exec-batch commands at once if --exec-jobs isn't given.
+  static size_t const DEFAULT_JOBS = 4;
+
+  uint64_t pids_max = UNLIMITED;
+  uint64_t pids_current = 0;
+  uint64_t memory_max = UNLIMITED;
+  uint64_t memory_current = 0;
+  double cpus = 0;              // 0 if unlimited
+  uint64_t nofile = UNLIMITED;
+  uint64_t fds_open = 0;
+
+  size_t threads = 0;           // probing threads at once
+  size_t conns = 0;             // event loop connections at once
+  size_t jobs = 0;              // --exec-batch commands at once
+  int rcvbuf = 0;               // --syn receive buffer
+  char const* bound = "";       // what limited threads the most
+
+  /* Read the limits, raising the soft RLIMIT_NOFILE to the hard one, and
+     size the scan to fit, along with JOBS --exec-batch commands at once,
+     or if CAP_JOBS, no more of them than there are CPUs. */
+  static Resources detect(size_t jobs, bool cap_jobs = false)
+  {
+    Resources r;
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+      if (rl.rlim_cur < rl.rlim_max)
+      {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+      }
+      if (rl.rlim_cur != RLIM_INFINITY)
+        r.nofile = rl.rlim_cur;
+    }
+    if (DIR* d = opendir("/proc/self/fd"))
+    {
+      while (readdir(d))
+        ++r.fds_open;
+      closedir(d);
+      r.fds_open -= std::min<uint64_t>(r.fds_open, 3); // ".", "..", d
+    }
+
+    std::string dir = cgroup_dir();
+    if (not dir.empty())
+    {
+      read_number(dir + "/pids.current", r.pids_current);
+      read_number(dir + "/memory.current", r.memory_current);
+      // A limit anywhere up the tree applies.
+      for (std::string d = dir; d.size() >= CGROUP_ROOT.size();
+           d.erase(d.rfind('/')))
+      {
+        uint64_t v;
+        if (read_number(d + "/pids.max", v))
+          r.pids_max = std::min(r.pids_max, v);
+        if (read_number(d + "/memory.max", v))
+          r.memory_max = std::min(r.memory_max, v);
+        std::string cpu = read_line(d + "/cpu.max");
+        double quota, period;
+        if (sscanf(cpu.c_str(), "%lf %lf", &quota, &period) == 2 and
+            period > 0 and (r.cpus == 0 or quota / period < r.cpus))
+          r.cpus = quota / period;
+        if (d == CGROUP_ROOT)
+          break;
+      }
+    }
+
+    // Left to us, no more commands than there are CPUs.  A number the user
+    // gave is kept; the commands may well spend their time waiting.
+    r.jobs = jobs;
+    if (cap_jobs and r.cpus > 0)
+      r.jobs = std::min<size_t>(jobs, std::max(1.0, std::ceil(r.cpus)));
+
+    // Leave some of each for the main thread, the event loop, the ring, the
+    // commands (a process and a pipe each) and so on.  The event loop's
+    // connections run alongside the threads, e.g. for --http.
+    uint64_t threads = UNLIMITED;
+    r.conns = 256;
+    r.bound = "none";
+    if (r.nofile != UNLIMITED)
+    {
+      uint64_t fds = r.nofile - std::min(r.nofile, r.fds_open + RESERVED_FDS +
+                                         2 * r.jobs);
+      r.conns = std::min<uint64_t>(r.conns, fds / 4);
+      threads = fds - r.conns;
+      r.bound = "RLIMIT_NOFILE";
+    }
+    if (r.pids_max != UNLIMITED)
+    {
+      uint64_t left = r.pids_max - std::min(r.pids_max, r.pids_current + 16 +
+                                            r.jobs);
+      if (left < threads)
+      {
+        threads = left;
+        r.bound = "pids.max";
+      }
+    }
+    if (r.memory_max != UNLIMITED)
+    {
+      // Keep half of what's left in reserve.
+      uint64_t left = (r.memory_max - std::min(r.memory_max,
+                                               r.memory_current)) / 2;
+      r.conns = std::min<uint64_t>(r.conns, left / THREAD_MEMORY);
+      if (left / THREAD_MEMORY < threads)
+      {
+        threads = left / THREAD_MEMORY;
+        r.bound = "memory.max";
+      }
+    }
+    r.threads = std::max<uint64_t>(1, std::min<uint64_t>(threads, 1 << 20));
+    r.conns = std::max<size_t>(1, r.conns);
+    r.rcvbuf = 8 << 20;
+    if (r.memory_max != UNLIMITED)
+      r.rcvbuf = std::max<uint64_t>(256 << 10, std::min<uint64_t>(
+                                      r.rcvbuf, r.memory_max / 16));
+    return r;
+  }
+
+  /* Use small stacks for the probing threads, which need little, so that
+     memory.max doesn't run out before the scan does. */
+  static void use_small_stacks()
+  {
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) != 0)
+      return;
+    if (pthread_attr_setstacksize(&attr, THREAD_STACK) == 0)
+      pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+  }
+
+  /* A one-line summary, for --debug. */
+  std::string describe() const
+  {
+    auto limit = [](uint64_t v) {
+      return v == UNLIMITED ? std::string("max") : std::to_string(v);
+    };
+    char cpu[32] = "max";
+    if (cpus > 0)
+      snprintf(cpu, sizeof(cpu), "%.2f", cpus);
+    return "limits: nofile " + limit(nofile) + ", pids.max " +
+      limit(pids_max) + ", memory.max " + limit(memory_max) + ", cpus " +
+      cpu + "; using " + std::to_string(threads) + " threads (bound by " +
+      bound + "), " + std::to_string(conns) + " connections, " +
+      std::to_string(jobs) + " commands, rcvbuf " + std::to_string(rcvbuf);
+  }
+
+private:
+  static std::string const CGROUP_ROOT;
+
+  /* Our cgroup v2 directory, or "" if there isn't one. */
+  static std::string cgroup_dir()
+  {
+    std::string line;
+    if (FILE* f = fopen("/proc/self/cgroup", "r"))
+    {
+      char buf[4096];
+      while (fgets(buf, sizeof(buf), f))
+        if (strncmp(buf, "0::", 3) == 0)
+        {
+          line = buf + 3;
+          break;
+        }
+      fclose(f);
+    }
+    while (not line.empty() and (line.back() == '\n' or line.back() == '/'))
+      line.pop_back();
+    if (line.empty() and access((CGROUP_ROOT + "/cgroup.controllers").c_str(),
+                                F_OK) != 0)
+      return {};
+    return CGROUP_ROOT + line;
+  }
+};
+
+std::string const Resources::CGROUP_ROOT = "/sys/fs/cgroup";
+
+/* Options shared by the scan and the check subcommand. */
+struct Options
+{
+  char const* listen_path = nullptr;
+  char const* ring_path = nullptr;
+  uint32_t ring_size = 1 << 20;
+};
+
+/* scanport check TIMEOUT INTERVAL FILE
+
+   Health-check the endpoints listed in FILE, one "ADDR:PORT" per line,
+   every INTERVAL seconds, reporting each change of state. */
+int check_main(int argc, char** argv, Options const& opts)
+{
+  if (argc != 3)
+    throw std::runtime_error("wrong usage");
+  auto timeout = string_to<Clock::duration>(argv[0]);
+  auto interval = string_to<Clock::duration>(argv[1]);
+  if (interval <= Clock::duration::zero())
+    throw std::runtime_error("Invalid interval '" + std::string(argv[1]) +
+                             '\'');
+
+  EventLoop loop;
+  int sigfd = stop_on_signals(loop);
+  std::shared_ptr<void> finally{ nullptr, [sigfd](void*) { close(sigfd); } };
+  Tracker tracker;
+  std::unique_ptr<RingWriter> ring;
+  if (opts.ring_path)
+  {
+    ring.reset(new RingWriter(opts.ring_path, opts.ring_size));
+    tracker.set_ring(ring.get());
+  }
+  std::unique_ptr<QueryServer> server;
+  if (opts.listen_path)
+    server.reset(new QueryServer(loop, tracker, opts.listen_path));
+  HealthChecker checker(loop, tracker, timeout, interval);
+  ResultReader reader(argv[2]);
+  uint64_t key;
+  while (reader.next(key))
+  {
+    if ((key & 0xffff) == 0)
+      reader.bad();
+    checker.add(key >> 16, key & 0xffff);
+  }
+  loop.run();
+  return 0;
+}
+
+/* Connect to the --listen socket at PATH. */
+int connect_unix(std::string const& path)
+{
+  sockaddr_un sa{};
+  sa.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(sa.sun_path))
+    throw std::runtime_error("Socket path too long '" + path + '\'');
+  memcpy(sa.sun_path, path.c_str(), path.size());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    throw std::runtime_error("socket: " + errStr());
+  if (connect(fd, (sockaddr*) &sa, sizeof(sa)) == -1)
+  {
+    int err = errno;
+    close(fd);
+    throw std::runtime_error("connect " + path + ": " + strerror(err));
+  }
+  return fd;
+}
+
+void write_all(int fd, char const* p, size_t len)
+{
+  while (len != 0)
+  {
+    ssize_t n = write(fd, p, len);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error("write: " + errStr());
+    }
+    p += n, len -= n;
+  }
+}
+
+/* Read exactly LEN bytes.  Returns false on EOF before the first byte. */
+bool read_all(int fd, char* p, size_t len)
+{
+  for (size_t got = 0; got < len;)
+  {
+    ssize_t n = read(fd, p + got, len - got);
+    if (n == -1 and errno == EINTR)
+      continue;
+    if (n == 0 and got == 0)
+      return false;
+    if (n <= 0)
+      throw std::runtime_error("read: " + (n ? errStr() : "EOF"));
+    got += n;
+  }
+  return true;
+}
+
+/* Print a query reply or event, at P, for the endpoint NAME. */
+void print_state(char const* name, char const* p)
+{
+  uint8_t state = p[1];
+  if (state == QUERY_UNKNOWN)
+  {
+    printf("%s unknown\n", name);
+    return;
+  }
+  uint32_t latency;
+  int64_t since;
+  memcpy(&latency, p + 4, 4);
+  memcpy(&since, p + 8, 8);
+  time_t t = be64toh(since) / 1000000;
+  char when[32];
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+  if (state == QUERY_UP)
+    printf("%s up since %s latency %.3fms\n", name, when,
+           be32toh(latency) / 1000.0);
+  else
+    printf("%s down %s since %s\n", name, outcome_name(Outcome(uint8_t(p[2]))),
+           when);
+}
+
+/* scanport query PATH ADDR:PORT...
+
+   Ask a scanport running with --listen=PATH about endpoints, all in one
+   round trip, and print "ADDR:PORT up since TIME latency LATENCY" or
+   "ADDR:PORT down REASON since TIME" for each. */
+int query_main(int argc, char** argv)
+{
+  if (argc < 2)
+    throw std::runtime_error("wrong usage");
+  int fd = connect_unix(argv[0]);
+  std::shared_ptr<void> finally{ nullptr, [fd](void*) { close(fd); } };
+
+  std::string requests;
+  for (int i = 1; i < argc; ++i)
+  {
+    uint64_t key = parse_result(argv[i]);
+    char request[QUERY_REQUEST_SIZE] = { char(QUERY_OP) };
+    uint16_t port = htons(key & 0xffff);
+    uint32_t addr = htonl(key >> 16);
+    memcpy(request + 2, &port, 2);
+    memcpy(request + 4, &addr, 4);
+    requests.append(request, sizeof(request));
+  }
+  write_all(fd, requests.data(), requests.size());
+
+  int status = 0;
+  for (int i = 1; i < argc; ++i)
+  {
+    char reply[QUERY_REPLY_SIZE];
+    if (not read_all(fd, reply, sizeof(reply)))
+      throw std::runtime_error("read: EOF");
+    print_state(argv[i], reply);
+    if (reply[1] == QUERY_UNKNOWN)
+      status = 1;
+  }
+  return status;
+}
+
+/* scanport subscribe PATH [ADDR[/LEN] [PORT [OUTCOME,...]]]
+
+   Print the changes of state that a scanport running with --listen=PATH
+   sees, optionally only those in a subnet, on a port, or with the given
+   outcomes (open, refused, timeout, unreachable, closed). */
+int subscribe_main(int argc, char** argv)
+{
+  if (argc < 1 or argc > 4)
+    throw std::runtime_error("wrong usage");
+  char request[SUBSCRIBE_REQUEST_SIZE] = { char(SUBSCRIBE_OP) };
+  if (argc > 1)
+  {
+    char const* p = argv[1];
+    uint32_t addr;
+    unsigned long len = 32;
+    bool ok = parse_ipv4(p, p + strlen(p), addr);
+    if (ok and *p != '\0')
+    {
+      char* end;
+      ok = *p == '/' and unsigned(p[1] - '0') < 10;
+      len = strtoul(p + 1, &end, 10);
+      ok = ok and *end == '\0' and len <= 32;
+    }
+    if (not ok)
+      throw std::runtime_error("Invalid subnet '" + std::string(argv[1]) +
+                               '\'');
+    request[1] = len;
+    addr = htonl(addr);
+    memcpy(request + 4, &addr, 4);
+  }
+  if (argc > 2)
+  {
+    uint16_t port = htons(string_to<uint16_t>(argv[2]));
+    memcpy(request + 2, &port, 2);
+  }
+  if (argc > 3)
+  {
+    std::string names = std::string(argv[3]) + ',';
+    for (size_t start = 0, comma; (comma = names.find(',', start)) !=
+           std::string::npos; start = comma + 1)
+    {
+      std::string name = names.substr(start, comma - start);
+      int o = 0;
+      while (o <= int(Outcome::closed) and name != outcome_name(Outcome(o)))
+        ++o;
+      if (o > int(Outcome::closed))
+        throw std::runtime_error("Invalid outcome '" + name + '\'');
+      request[8] |= 1 << o;
+    }
+  }
+
+  int fd = connect_unix(argv[0]);
+  std::shared_ptr<void> finally{ nullptr, [fd](void*) { close(fd); } };
+  write_all(fd, request, sizeof(request));
+  char event[EVENT_SIZE];
+  while (read_all(fd, event, sizeof(event)))
+  {
+    if (uint8_t(event[0]) == EVENTS_LOST_OP)
+    {
+      uint32_t n;
+      memcpy(&n, event + 4, 4);
+      fflush(stdout);
+      std::clog << program_name << ": " << be32toh(n) << " events lost\n";
+      continue;
+    }
+    uint32_t addr;
+    uint16_t port;
+    memcpy(&addr, event + 16, 4);
+    memcpy(&port, event + 20, 2);
+    std::string name = ipv4_string(ntohl(addr)) + ":" +
+      std::to_string(ntohs(port));
+    print_state(name.c_str(), event);
+    fflush(stdout);
+  }
+  return 0;
+}
+
+/* scanport ring FILE
+
+   Follow a --ring file, printing "ADDR:PORT OUTCOME LATENCY" for each
+   result as it is written. */
+int ring_main(int argc, char** argv)
+{
+  if (argc != 1)
+    throw std::runtime_error("wrong usage");
+  scanport::RingReader reader(argv[0]);
+  scanport::RingRecord rec;
+  uint64_t lost = 0;
+  for (;;)
+  {
+    if (not reader.next(rec))
+    {
+      fflush(stdout);
+      usleep(1000);
+      continue;
+    }
+    if (reader.lost() != lost)
+    {
+      fflush(stdout);
+      std::clog << program_name << ": " << reader.lost() - lost
+                << " results lost\n";
+      lost = reader.lost();
+    }
+    char buf[IPV4_MAXLEN + 40];
+    size_t n = format_ipv4(rec.addr, buf);
+    n += snprintf(buf + n, sizeof(buf) - n, ":%u %s %.3fms\n", rec.port,
+                  outcome_name(Outcome(rec.outcome)), rec.latency_us / 1000.0);
+    fwrite(buf, 1, n, stdout);
+  }
+}
+
+/* The IPv6 hosts on interface IFINDEX that answer an ICMPv6 echo to the
+   all-nodes group, ff02::1, within WAIT.  The echo goes out twice in case
+   one is lost.  Uses a raw socket if allowed, else a ping socket. */
+std::vector<in6_addr> echo_neighbors6(unsigned ifindex, Clock::duration wait)
+{
+  int fd = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+  if (fd == -1 and (errno == EPERM or errno == EACCES))
+    fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+  if (fd == -1)
+    throw std::runtime_error("socket: " + errStr());
+  std::shared_ptr<void> finally{ nullptr, [fd](void*) { close(fd); } };
+  int hops = 1;
+  if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex,
+                 sizeof(ifindex)) == -1 or
+      setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops,
+                 sizeof(hops)) == -1)
+    throw std::runtime_error("setsockopt: " + errStr());
+
+  static char const MAGIC[8] = { 's', 'c', 'a', 'n', 'p', 'o', 'r', 't' };
+  unsigned char echo[8 + sizeof(MAGIC)] = { ICMP6_ECHO_REQUEST };
+  uint16_t id = htons(getpid());
+  memcpy(echo + 4, &id, 2);
+  memcpy(echo + 8, MAGIC, sizeof(MAGIC));
+  sockaddr_in6 all{};
+  all.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "ff02::1", &all.sin6_addr);
+  all.sin6_scope_id = ifindex;
+
+  std::vector<in6_addr> found;
+  auto start = Clock::now();
+  auto deadline = start + wait;
+  auto resend = start;
+  for (int sent = 0;;)
+  {
+    auto now = Clock::now();
+    if (sent < 2 and now >= resend)
+    {
+      echo[7] = ++sent;          // sequence number
+      if (sendto(fd, echo, sizeof(echo), 0, (sockaddr*) &all,
+                 sizeof(all)) == -1)
+        throw std::runtime_error("sendto ff02::1: " + errStr());
+      resend = start + wait / 2;
+    }
+    if (now >= deadline)
+      break;
+    auto until = sent < 2 ? std::min(resend, deadline) : deadline;
+    pollfd pfd{ fd, POLLIN, 0 };
+    timespec ts = to_timespec(until - now);
+    if (ppoll(&pfd, 1, &ts, nullptr) == -1 and errno != EINTR)
+      throw std::runtime_error("ppoll: " + errStr());
+    unsigned char reply[1500];
+    sockaddr_in6 from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t n;
+    while ((n = recvfrom(fd, reply, sizeof(reply), MSG_DONTWAIT,
+                         (sockaddr*) &from, &fromlen)) != -1)
+    {
+      // A raw socket also sees other ICMPv6, including our own request.
+      if (size_t(n) >= sizeof(echo) and reply[0] == ICMP6_ECHO_REPLY and
+          memcmp(reply + 8, MAGIC, sizeof(MAGIC)) == 0)
+        found.push_back(from.sin6_addr);
+      fromlen = sizeof(from);
+    }
+  }
+  return found;
+}
+
+/* Send the netlink dump request REQ, LEN bytes, over a new socket of
+   netlink PROTOCOL, and call EACH with every message of the answer. */
+void netlink_dump(int protocol, void const* req, size_t len,
+                  std::function<void(nlmsghdr const* nh)> const& each)
+{
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+  if (fd == -1)
+    throw std::runtime_error("socket: " + errStr());
+  std::shared_ptr<void> finally{ nullptr, [fd](void*) { close(fd); } };
+  if (send(fd, req, len, 0) == -1)
+    throw std::runtime_error("send netlink: " + errStr());
+  alignas(nlmsghdr) char buf[32768];
+  for (;;)
+  {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error("recv netlink: " + errStr());
+    }
+    int left = n;
+    for (auto nh = (nlmsghdr const*) buf; NLMSG_OK(nh, left);
+         nh = NLMSG_NEXT(nh, left))
+    {
+      if (nh->nlmsg_type == NLMSG_DONE)
+        return;
+      if (nh->nlmsg_type == NLMSG_ERROR)
+      {
+        errno = -((nlmsgerr const*) NLMSG_DATA(nh))->error;
+        throw std::runtime_error("netlink: " + errStr());
+      }
+      each(nh);
+    }
+  }
+}
+
+/* The addresses in the kernel's IPv6 neighbor cache for interface
+   IFINDEX, other than those known to be unreachable. */
+std::vector<in6_addr> cached_neighbors6(unsigned ifindex)
+{
+  struct
+  {
+    nlmsghdr nh;
+    ndmsg nd;
+  } req{};
+  req.nh.nlmsg_len = sizeof(req);
+  req.nh.nlmsg_type = RTM_GETNEIGH;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nd.ndm_family = AF_INET6;
+  std::vector<in6_addr> found;
+  netlink_dump(NETLINK_ROUTE, &req, sizeof(req), [&](nlmsghdr const* nh) {
+      auto nd = (ndmsg const*) NLMSG_DATA(nh);
+      if (unsigned(nd->ndm_ifindex) != ifindex or nd->ndm_state == NUD_NONE or
+          (nd->ndm_state & (NUD_INCOMPLETE | NUD_FAILED | NUD_NOARP)))
+        return;
+      int len = NLMSG_PAYLOAD(nh, sizeof(*nd));
+      for (auto rta = (rtattr const*) ((char const*) nd +
+                                       NLMSG_ALIGN(sizeof(*nd)));
+           RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+        if (rta->rta_type == NDA_DST and RTA_PAYLOAD(rta) == sizeof(in6_addr))
+        {
+          found.emplace_back();
+          memcpy(&found.back(), RTA_DATA(rta), sizeof(in6_addr));
+        }
+    });
+  return found;
+}
+
+/* The peers of this namespace's established TCP connections to PORT, over
+   IPv4 or IPv4-mapped IPv6, each with the smoothed RTT the kernel keeps
+   for the connection, as sock_diag reports them. */
+std::unordered_map<uint32_t, Clock::duration> established_peers(uint16_t port)
+{
+  std::unordered_map<uint32_t, Clock::duration> peers;
+  for (int family : { AF_INET, AF_INET6 })
+  {
+    struct
+    {
+      nlmsghdr nh;
+      inet_diag_req_v2 req;
+    } req{};
+    req.nh.nlmsg_len = sizeof(req);
+    req.nh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.req.sdiag_family = family;
+    req.req.sdiag_protocol = IPPROTO_TCP;
+    req.req.idiag_states = 1 << TCP_ESTABLISHED;
+    req.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+    netlink_dump(NETLINK_SOCK_DIAG, &req, sizeof(req),
+                 [&](nlmsghdr const* nh) {
+      auto msg = (inet_diag_msg const*) NLMSG_DATA(nh);
+      if (ntohs(msg->id.idiag_dport) != port)
+        return;
+      uint32_t const* dst = msg->id.idiag_dst;
+      if (family == AF_INET6)
+      {
+        if (dst[0] != 0 or dst[1] != 0 or dst[2] != htonl(0xffff))
+          return;
+        dst += 3;
+      }
+      Clock::duration rtt{};
+      int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+      for (auto rta = (rtattr const*) (msg + 1); RTA_OK(rta, len);
+           rta = RTA_NEXT(rta, len))
+        if (rta->rta_type == INET_DIAG_INFO and
+            RTA_PAYLOAD(rta) >= offsetof(tcp_info, tcpi_rttvar))
+        {
+          tcp_info info{};
+          memcpy(&info, RTA_DATA(rta),
+                 std::min(size_t(RTA_PAYLOAD(rta)), sizeof(info)));
+          rtt = std::chrono::microseconds(info.tcpi_rtt);
+        }
+      peers.emplace(ntohl(*dst), rtt);
+    });
+  }
+  return peers;
+}
+
+/* scanport lan6 TIMEOUT PORT IFACE
+
+   The IPv6 counterpart of scanning a /24, where enumerating the subnet is
+   out of the question: find the hosts on the link at IFACE, from the
+   answers to an ICMPv6 echo to all nodes and from the neighbor cache, then
+   try connecting to PORT on each.  TIMEOUT is how long to wait for echo
+   replies and then for each connection.  Prints the open hosts in address
+   order, "ADDR%IFACE" for link-local ones. */
+int lan6_main(int argc, char** argv)
+{
+  if (argc != 3)
+    throw std::runtime_error("wrong usage");
+  auto timeout = string_to<Clock::duration>(argv[0]);
+  auto port = string_to<uint16_t>(argv[1]);
+  std::string iface = argv[2];
+  unsigned ifindex = if_nametoindex(iface.c_str());
+  if (ifindex == 0)
+    throw std::runtime_error(iface + ": " + errStr());
+
+  auto hosts = echo_neighbors6(ifindex, timeout);
+  size_t echoed = hosts.size();
+  auto cached = cached_neighbors6(ifindex);
+  hosts.insert(hosts.end(), cached.begin(), cached.end());
+  std::sort(hosts.begin(), hosts.end(),
+            [](in6_addr const& a, in6_addr const& b) {
+              return memcmp(&a, &b, sizeof(a)) < 0;
+            });
+  hosts.erase(std::unique(hosts.begin(), hosts.end(),
+                          [](in6_addr const& a, in6_addr const& b) {
+                            return memcmp(&a, &b, sizeof(a)) == 0;
+                          }),
+              hosts.end());
+
+  auto name = [&](in6_addr const& addr) {
+    char buf[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &addr, buf, sizeof(buf));
+    return std::string(buf) + (IN6_IS_ADDR_LINKLOCAL(&addr) ? "%" + iface
+                               : std::string());
+  };
+  if (debug)
+    std::clog << std::to_string(hosts.size()) + " hosts on " + iface + " (" +
+      std::to_string(echoed) + " echo replies, " +
+      std::to_string(cached.size()) + " cached neighbors)\n";
+
+  // No more connections at once than the limits allow, nor than the
+  // default --headroom leaves room for.
+  Resources res = Resources::detect(0);
+  if (debug)
+    std::clog << res.describe() + "\n";
+  Throttle throttle(0.2, hosts.size(), false);
+  EventLoop loop;
+  std::vector<Outcome> outcomes(hosts.size(), Outcome::timeout);
+  ConnectScanner scanner(
+    loop, timeout, res.conns,
+    [&throttle](size_t) -> Throttle& { return throttle; },
+    [](size_t) {
+      return socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    },
+    [&outcomes](size_t i, Probe const& probe) {
+      outcomes[i] = probe.outcome;
+    });
+  scanner.run(hosts.size(),
+              [&](size_t i, sockaddr_storage& sa) -> socklen_t {
+                auto& sin6 = reinterpret_cast<sockaddr_in6&>(sa);
+                sin6 = sockaddr_in6{};
+                sin6.sin6_family = AF_INET6;
+                sin6.sin6_port = htons(port);
+                sin6.sin6_addr = hosts[i];
+                if (IN6_IS_ADDR_LINKLOCAL(&sin6.sin6_addr))
+                  sin6.sin6_scope_id = ifindex;
+                return sizeof(sin6);
+              },
+              [&](size_t i) { return name(hosts[i]); });
+  for (size_t i = 0; i < hosts.size(); ++i)
+    if (outcomes[i] == Outcome::open)
+      printf("%s\n", name(hosts[i]).c_str());
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+try
+{
+  program_name = basename(argv[0]);
+
+  bool syn = false;
+  bool sorted = false;
+  char const* summary_path = nullptr;
+  bool summary_json = false;
+  int summary_prefix = 24;
+  bool watch = false;
+  int keepalive = 10;
+  Options opts;
+  char const* exec_cmd = nullptr;
+  size_t exec_size = 100;
+  size_t exec_jobs = 0;         // 0: --exec-jobs not given
+  bool exec_stdin = false;
+  char const* resolver = nullptr;
+  char const* targets_path = nullptr;
+  bool rdns = false;
+  Clock::duration rdns_budget = std::chrono::seconds(1);
+  bool http = false;
+  ServiceProbe::Http http_opts;
+  bool banner = false;
+  bool fingerprint = false;
+  unsigned headroom = 20;
+  bool progress = false;
+  bool probe_all = false;
+  int status = EXIT_SUCCESS;
+  std::vector<ConnectScanner::Proxy> proxies;
+  for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; --argc, ++argv)
+  {
+    if (strcmp(argv[1], "--debug") == 0)
+      debug = true;
+    else if (strcmp(argv[1], "--syn") == 0)
+      syn = true;
+    else if (strcmp(argv[1], "--sorted") == 0)
+      sorted = true;
+    else if (strcmp(argv[1], "--watch") == 0)
+      watch = true;
+    else if (strncmp(argv[1], "--keepalive=", 12) == 0)
+    {
+      keepalive = string_to<uint16_t>(argv[1] + 12);
+      if (keepalive == 0)
+        throw std::runtime_error("Invalid keepalive '0'");
+    }
+    else if (strncmp(argv[1], "--exec-batch=", 13) == 0)
+      exec_cmd = argv[1] + 13;
+    else if (strncmp(argv[1], "--batch-size=", 13) == 0)
+      exec_size = std::max(1u, string_to<uint32_t>(argv[1] + 13));
+    else if (strncmp(argv[1], "--exec-jobs=", 12) == 0)
+      exec_jobs = std::max(1u, string_to<uint32_t>(argv[1] + 12));
+    else if (strcmp(argv[1], "--exec-stdin") == 0)
+      exec_stdin = true;
+    else if (strncmp(argv[1], "--resolver=", 11) == 0)
+      resolver = argv[1] + 11;
+    else if (strncmp(argv[1], "--targets=", 10) == 0)
+      targets_path = argv[1] + 10;
+    else if (strcmp(argv[1], "--http") == 0)
+      http = true;
+    else if (strncmp(argv[1], "--http=", 7) == 0)
+    {
+      http = true;
+      http_opts.path = argv[1] + 7;
+      if (http_opts.path[0] != '/')
+        throw std::runtime_error("Invalid HTTP path '" + http_opts.path +
+                                 '\'');
+    }
+    else if (strcmp(argv[1], "--http-get") == 0)
+      http_opts.method = "GET";
+    else if (strncmp(argv[1], "--http-headers=", 15) == 0)
+    {
+      auto& http_headers = http_opts.headers;
+      http_headers.clear();
+      std::string list = argv[1] + 15;
+      for (size_t b = 0; b <= list.size();)
+      {
+        size_t comma = std::min(list.find(',', b), list.size());
+        if (comma > b)
+          http_headers.push_back(list.substr(b, comma - b));
+        b = comma + 1;
+      }
+    }
+    else if (strcmp(argv[1], "--banner") == 0)
+      banner = true;
+    else if (strcmp(argv[1], "--fingerprint") == 0)
+      fingerprint = true;
+    else if (strncmp(argv[1], "--headroom=", 11) == 0)
+    {
+      headroom = string_to<uint32_t>(argv[1] + 11);
+      if (headroom >= 100)
+        throw std::runtime_error("Invalid headroom '" +
+                                 std::string(argv[1] + 11) + '\'');
+    }
+    else if (strncmp(argv[1], "--proxy=", 8) == 0)
+      parse_proxies(argv[1] + 8, proxies);
+    else if (strcmp(argv[1], "--probe-all") == 0)
+      probe_all = true;
+    else if (strcmp(argv[1], "--progress") == 0)
+      progress = true;
+    else if (strcmp(argv[1], "--rdns") == 0)
+      rdns = true;
+    else if (strncmp(argv[1], "--rdns-budget=", 14) == 0)
+      rdns_budget = string_to<Clock::duration>(argv[1] + 14);
+    else if (strncmp(argv[1], "--listen=", 9) == 0)
+      opts.listen_path = argv[1] + 9;
+    else if (strncmp(argv[1], "--ring=", 7) == 0)
+      opts.ring_path = argv[1] + 7;
+    else if (strncmp(argv[1], "--ring-size=", 12) == 0)
+      opts.ring_size = string_to<uint32_t>(argv[1] + 12);
+    else if (strncmp(argv[1], "--summary=", 10) == 0)
+      summary_path = argv[1] + 10;
+    else if (strncmp(argv[1], "--summary-json=", 15) == 0)
+    {
+      summary_path = argv[1] + 15;
+      summary_json = true;
+    }
+    else if (strncmp(argv[1], "--summary-prefix=", 17) == 0)
+    {
+      summary_prefix = string_to<uint16_t>(argv[1] + 17);
+      if (summary_prefix > 32)
+        throw std::runtime_error("Invalid prefix length '" +
+                                 std::string(argv[1] + 17) + '\'');
+    }
+    else
+      throw std::runtime_error("Unknown option '" + std::string(argv[1]) +
+                               '\'');
+  }
+
+  if (argc > 1 && strcmp(argv[1], "merge") == 0)
+    return merge_main(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "snapshot") == 0)
+    return snapshot_main(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "check") == 0)
+    return check_main(argc - 2, argv + 2, opts);
+  if (argc > 1 && strcmp(argv[1], "query") == 0)
+    return query_main(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "subscribe") == 0)
+    return subscribe_main(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "ring") == 0)
+    return ring_main(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "lan6") == 0)
+    return lan6_main(argc - 2, argv + 2);
+  if (opts.listen_path and not watch)
+    throw std::runtime_error("--listen needs --watch or check");
+  if (not proxies.empty() and (syn or watch or http or banner))
+    throw std::runtime_error("--proxy can't be used with --syn, --watch,"
+                             " --http or --banner");
+  if (fingerprint and not syn)
+    throw std::runtime_error("--fingerprint needs --syn");
+  if (fingerprint and (rdns or http or banner))
+    throw std::runtime_error("--fingerprint can't be used with --rdns, --http"
+                             " or --banner");
+  if (http and banner)
+    throw std::runtime_error("--http and --banner can't be used together");
+  if ((http or banner) and (sorted or rdns))
+    throw std::runtime_error("--http and --banner can't be used with --sorted"
+                             " or --rdns");
+
+  if (argc < (targets_path ? 3 : 4))
+    throw std::runtime_error("wrong usage");
+  auto timeout = string_to<Clock::duration>(*++argv);
+  auto port = string_to<uint16_t>(*++argv);
+  argc -= 3;
+
+  std::vector<std::string> targets(argv + 1, argv + 1 + argc);
+  if (targets_path)
+  {
+    MappedFile file(targets_path);
+    for (char const* p = file.begin(); p != file.end();)
+    {
+      char const* nl = static_cast<char const*>(
+        memchr(p, '\n', file.end() - p));
+      char const* eol = nl ? nl : file.end();
+      std::string line(p, eol);
+      size_t hash = line.find('#');
+      if (hash != std::string::npos)
+        line.erase(hash);
+      size_t b = line.find_first_not_of(" \t\r");
+      if (b != std::string::npos)
+        targets.push_back(
+          line.substr(b, line.find_last_not_of(" \t\r") + 1 - b));
+      p = nl ? nl + 1 : eol;
+    }
+  }
+  // Name lookups, --rdns and --watch all share one event loop.
+  EventLoop loop;
+  Resolver dns(loop, resolver_address(resolver));
+  // TARGET@PATH probes TARGET from inside the network namespace at PATH.
+  // netns[i] is 0 for the own namespace, else 1 + an index into
+  // netns_paths.
+  std::vector<std::string> netns_paths;
+  std::vector<size_t> target_netns(targets.size());
+  for (size_t k = 0; k < targets.size(); ++k)
+  {
+    size_t at = targets[k].find('@');
+    if (at == std::string::npos)
+      continue;
+    std::string path = targets[k].substr(at + 1);
+    targets[k].erase(at);
+    if (path.empty())
+      throw std::runtime_error("Invalid namespace in target '" + targets[k] +
+                               "@'");
+    auto found = std::find(netns_paths.begin(), netns_paths.end(), path);
+    target_netns[k] = 1 + (found - netns_paths.begin());
+    if (found == netns_paths.end())
+      netns_paths.push_back(path);
+  }
+  if (not netns_paths.empty() and
+      (not proxies.empty() or syn or sorted or watch or rdns or http or
+       banner or exec_cmd))
+    throw std::runtime_error("TARGET@NETNS can't be used with --proxy, --syn,"
+                             " --sorted, --watch, --rdns, --http, --banner"
+                             " or --exec-batch");
+  std::vector<size_t> origin;
+  auto addrs = expand_targets(targets, loop, dns, &origin);
+  std::vector<size_t> netns(addrs.size());
+  for (size_t i = 0; i < addrs.size(); ++i)
+    netns[i] = target_netns[origin[i]];
+
+  Resources res = exec_cmd == nullptr ? Resources::detect(0) :
+    exec_jobs == 0 ? Resources::detect(Resources::DEFAULT_JOBS, true) :
+    Resources::detect(exec_jobs);
+  if (exec_cmd and exec_jobs > 0 and res.cpus > 0 and
+      exec_jobs > std::ceil(res.cpus))
+    std::clog << program_name << ": --exec-jobs=" << exec_jobs
+              << " is more than the " << res.cpus << " CPUs available"
+              << std::endl;
+  exec_jobs = std::max<size_t>(1, res.jobs);
+  if (debug)
+    std::clog << res.describe() + "\n";
+  else if (not syn and netns_paths.empty() and proxies.empty() and
+           res.threads < addrs.size())
+    std::clog << program_name << ": probing " << res.threads
+              << " hosts at a time (bound by " << res.bound << ")"
+              << std::endl;
+  std::unique_ptr<ReverseNames> names;
+  if (rdns)
+    names.reset(new ReverseNames(loop, dns, rdns_budget));
+  std::unique_ptr<ServiceProbe> service;
+  if (http or banner)
+    service.reset(new ServiceProbe(loop, timeout,
+                                   http ? &http_opts : nullptr, res.conns));
+
+  std::unique_ptr<Summary> summary;
+  if (summary_path)
+    summary.reset(new Summary(addrs, summary_prefix));
+
+  // In --watch mode the scan seeds the state of every endpoint, so queries
+  // can be answered about the ones that were down too.
+  std::unique_ptr<Tracker> tracker;
+  if (watch)
+    tracker.reset(new Tracker);
+  std::unique_ptr<RingWriter> ring;
+  if (opts.ring_path)
+    ring.reset(new RingWriter(opts.ring_path, opts.ring_size));
+  std::unique_ptr<ExecBatch> exec;
+  if (exec_cmd)
+    exec.reset(new ExecBatch(exec_cmd, port, exec_size, exec_jobs,
+                             exec_stdin));
+
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> open_addrs;
+  std::unordered_map<uint32_t, Fingerprint> fingerprints;
+  auto print_host = [&](uint32_t addr) {
+    if (fingerprint)
+      print_fingerprint(addr, fingerprints[addr]);
+    else
+      print_ipv4(addr);
+  };
+  auto report = [&](size_t i, Probe const& probe) {
+    uint32_t addr = addrs[i];
+    if (ring)
+      ring->write(addr, port, probe);
+    if (tracker)
+      tracker->record(addr, port, probe, true);
+    if (probe.outcome != Outcome::open)
+      return;
+    if (watch)
+      open_addrs.push_back(addr);
+    if (exec)
+      exec->add(addr);
+    if (sorted)
+    {
+      keys.push_back(result_key(addr, port));
+      if (names)
+        names->prefetch(addr);
+    }
+    else if (names)
+      names->print(addr);
+    else if (service)
+    {
+      if (not syn)              // --syn streams them to it as they come
+        service->add(addr, port);
+    }
+    else if (netns[i])
+      printf("%s@%s\n", ipv4_string(addr).c_str(),
+             netns_paths[netns[i] - 1].c_str());
+    else
+      print_host(addr);
+  };
+
+  // Targets we already hold connections to are open; don't probe them.
+  // Their time to answer is the connection's RTT.
+  if (not probe_all and not fingerprint and proxies.empty())
+  {
+    std::unordered_map<uint32_t, Clock::duration> peers;
+    try
+    {
+      peers = established_peers(port);
+    }
+    catch (std::runtime_error& exc)
+    {
+      if (debug)
+        std::clog << "sock_diag: " + std::string(exc.what()) + "\n";
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < addrs.size(); ++i)
+    {
+      auto found = netns[i] ? peers.end() : peers.find(addrs[i]);
+      if (found == peers.end())
+      {
+        addrs[kept] = addrs[i];
+        netns[kept++] = netns[i];
+        continue;
+      }
+      if (debug)
+        std::clog << ipv4_string(addrs[i]) + " - established\n";
+      Probe probe{ Outcome::open, found->second };
+      if (summary)
+        summary->add(addrs[i], probe);
+      report(i, probe);
+      if (syn and service)      // the SYN scan won't stream it
+        service->add(addrs[i], port);
+    }
+    addrs.resize(kept);
+    netns.resize(kept);
+  }
+  Throttle throttle(headroom / 100.0, addrs.size(), progress);
+
+  if (syn and service)
+  {
+    // Discovery and the follow-up connections run at once: the scan thread
+    // streams open hosts through a bounded queue to the event loop, and
+    // stops sending while the follow-ups can't keep up.
+    HitQueue hits(4 * service->max_conns());
+    auto feed = [&]() {
+      uint32_t addr;
+      while (service->backlog() < 2 * service->max_conns() and
+             hits.pop(addr))
+        service->add(addr, port);
+      if (hits.done())
+        loop.stop();
+    };
+    service->on_room(feed);
+    loop.add(hits.fd(), EPOLLIN, [&](uint32_t) {
+        hits.ack();
+        feed();
+      });
+    auto scan = std::async(std::launch::async, [&]() {
+        std::shared_ptr<void> finally{ nullptr,
+            [&hits](void*) { hits.close_input(); } };
+        SynOptions so;
+        so.rcvbuf = res.rcvbuf;
+        so.hits = &hits;
+        so.throttle = &throttle;
+        return syn_scan(timeout, port, addrs, so);
+      });
+    loop.run();
+    loop.remove(hits.fd());
+    service->on_room(nullptr);
+    auto probes = scan.get();
+    for (size_t i = 0; i < addrs.size(); ++i)
+    {
+      if (summary)
+        summary->add(addrs[i], probes[i]);
+      report(i, probes[i]);
+    }
+  }
+  else if (syn)
+  {
+    std::vector<Fingerprint> prints;
+    SynOptions so;
+    so.rcvbuf = res.rcvbuf;
+    so.prints = fingerprint ? &prints : nullptr;
+    so.throttle = &throttle;
+    auto probes = syn_scan(timeout, port, addrs, so);
+    for (size_t i = 0; i < addrs.size(); ++i)
+    {
+      if (fingerprint and probes[i].outcome == Outcome::open)
+        fingerprints[addrs[i]] = prints[i];
+      if (summary)
+        summary->add(addrs[i], probes[i]);
+      report(i, probes[i]);
+    }
+  }
+  else if (not netns_paths.empty() or not proxies.empty())
+  {
+    // Sockets for other namespaces come from a helper thread that has
+    // switched into them; the connects, and SOCKS5 handshakes, all run here
+    // on the event loop.  Results are reported in target order.
+    std::unique_ptr<NetnsSockets> sockets;
+    // Each namespace has its own conntrack table and port range, so its
+    // own Throttle too.
+    std::vector<std::unique_ptr<Throttle>> throttles;
+    if (not netns_paths.empty())
+    {
+      sockets.reset(new NetnsSockets(netns_paths));
+      std::vector<size_t> totals(netns_paths.size() + 1);
+      for (auto ns : netns)
+        ++totals[ns];
+      throttles.emplace_back(new Throttle(headroom / 100.0, totals[0],
+                                          progress));
+      for (size_t ns = 1; ns < totals.size(); ++ns)
+        throttles.emplace_back(
+          new Throttle(headroom / 100.0, totals[ns], progress,
+                       sockets->limits(ns - 1), netns_paths[ns - 1]));
+    }
+    std::vector<Probe> probes(addrs.size());
+    std::vector<bool> ready(addrs.size());
+    size_t reported = 0;
+    ConnectScanner scanner(
+      loop, timeout, res.conns,
+      [&](size_t i) -> Throttle& {
+        return throttles.empty() ? throttle : *throttles[netns[i]];
+      },
+      [&](size_t i) {
+        return netns[i] ? sockets->make(netns[i] - 1) : tcp_socket();
+      },
+      [&](size_t i, Probe const& probe) {
+        if (summary)
+          summary->add(addrs[i], probe);
+        probes[i] = probe;
+        ready[i] = true;
+        for (; reported < addrs.size() and ready[reported]; ++reported)
+          report(reported, probes[reported]);
+        fflush(stdout);
+      });
+    if (not proxies.empty())
+      scanner.use_socks5(proxies);
+    scanner.run(addrs, port);
+    if (scanner.proxies_lost())
+    {
+      fflush(stdout);
+      std::clog << program_name << ": No SOCKS5 proxy left" << std::endl;
+      status = EXIT_FAILURE;
+    }
+  }
+  else
+  {
+    // Each thread adds its own result to the summary as soon as it has it.
+    // While reverse lookups or HTTP probes run on the loop, a finished
+    // thread marks its target done and wakes the loop through DONE_FD.
+    // The mark comes first, so a wakeup is never lost between checking it
+    // and waiting.
+    std::unique_ptr<std::atomic<bool>[]> done(
+      new std::atomic<bool>[addrs.size()]());
+    int done_fd = -1;
+    if (names or service)
+    {
+      done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (done_fd == -1)
+        throw std::runtime_error("eventfd: " + errStr());
+      loop.add(done_fd, EPOLLIN, [&loop, done_fd](uint32_t) {
+        uint64_t n;
+        if (read(done_fd, &n, sizeof(n)) == -1 and errno != EAGAIN)
+          throw std::runtime_error("read eventfd: " + errStr());
+        loop.stop();
+      });
+    }
+    auto mark_done = [&done, done_fd](size_t i) {
+      done[i] = true;
+      uint64_t one = 1;
+      if (done_fd != -1 and write(done_fd, &one, sizeof(one)) == -1 and
+          errno != EAGAIN)
+        throw std::runtime_error("write eventfd: " + errStr());
+    };
+    auto probe = [&summary, mark_done](Clock::duration timeout,
+                                       uint32_t addr, int port, size_t i) {
+      Probe p;
+      try
+      {
+        p = try_host(timeout, addr, port);
+      }
+      catch (...)
+      {
+        // Wake the loop for a failed probe too, so that its error gets to
+        // get() instead of the loop waiting for it forever.
+        mark_done(i);
+        throw;
+      }
+      if (summary)
+        summary->add(addr, p);
+      mark_done(i);
+      return p;
+    };
+    // A thread per target, but no more at once than the limits allow.
+    // futures[k] is the probe of addrs[i + k].
+    using Future = std::future<Probe>;
+    std::deque<Future> futures;
+    size_t window = res.threads;
+    size_t launched = 0;
+    Resources::use_small_stacks();
+    for (size_t i = 0; i < addrs.size(); ++i)
+    {
+      while (launched < addrs.size() and launched - i < window)
+      {
+        if (not throttle.admit(launched - i))
+        {
+          // Wait for a probe to finish, or for room to free up elsewhere.
+          if (not futures.empty())
+            break;
+          usleep(10000);
+          continue;
+        }
+        try
+        {
+          futures.emplace_back(std::async(std::launch::async, probe, timeout,
+                                          addrs[launched], port, launched));
+          ++launched;
+        }
+        catch (std::system_error& exc)
+        {
+          // Out of threads after all: make do with the ones running.
+          throttle.cancel();
+          if (futures.empty())
+            throw;
+          window = launched - i;
+          if (debug)
+            std::clog << "std::async: " + std::string(exc.what()) +
+              "; using " + std::to_string(window) + " threads\n";
+        }
+      }
+      // Answer reverse lookups and HTTP probes while waiting for the
+      // connections.
+      if (names or service)
+        while (not done[i])
+          loop.run();
+      Probe p = futures.front().get();
+      futures.pop_front();
+      report(i, p);
+      // Keep streaming, but don't flush for every line when results are
+      // already waiting.
+      if (not sorted and not futures.empty() and
+          futures.front().wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready)
+        fflush(stdout);
+    }
+    if (done_fd != -1)
+    {
+      loop.remove(done_fd);
+      close(done_fd);
+    }
+  }
+
+  if (sorted)
+  {
+    radix_sort(keys, 48);
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    for (auto key : keys)
+      if (names)
+        names->print(key >> 16);
+      else
+        print_host(key >> 16);
+  }
+
+  if (names)
+    names->drain();
+  if (service)
+    service->drain();
+
+  if (exec)
+    exec->finish();
+
+  if (summary)
+  {
+    FILE* f = stdout;
+    if (strcmp(summary_path, "-") != 0)
+    {
+      fflush(stdout);
+      f = fopen(summary_path, "w");
+      if (not f)
+        throw std::runtime_error("fopen " + std::string(summary_path) + ": " +
+                                 errStr());
+    }
+    if (summary_json)
+      summary->print_json(f);
+    else
+      summary->print_table(f);
+    if (f != stdout and fclose(f) != 0)
+      throw std::runtime_error("write " + std::string(summary_path) + ": " +
+                               errStr());
+  }
 
-  for (auto& f : futures)
+  if (watch)
   {
-    auto ipaddr = f.get();
-    if (not ipaddr.empty())
-      std::cout << ipaddr << std::endl;
+    fflush(stdout);
+    int sigfd = stop_on_signals(loop);
+    std::shared_ptr<void> finally{ nullptr, [sigfd](void*) { close(sigfd); } };
+    std::unique_ptr<QueryServer> server;
+    if (opts.listen_path)
+      server.reset(new QueryServer(loop, *tracker, opts.listen_path));
+    // The scan results are in the ring already.
+    tracker->set_ring(ring.get());
+    if (names)
+      tracker->set_namer([&names](uint32_t addr) {
+          return names->name(addr);
+        });
+    Watcher watcher(loop, *tracker, timeout, keepalive);
+    for (auto addr : open_addrs)
+      watcher.add(addr, port);
+    loop.run();
   }
+  return status;
 }
 catch (std::exception& exc)
 {
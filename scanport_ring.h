@@ -0,0 +1,274 @@
+/*
+  Layout of the result ring file written by "scanport --ring=FILE", and the
+  writer and a reader for it.  A consumer process maps the file and follows
+  the writer without system calls or parsing:
+
+    scanport::RingReader ring("/dev/shm/scanport.ring");
+    scanport::RingRecord rec;
+    for (;;)
+      if (ring.next(rec))
+        handle(rec);
+      else
+        usleep(100);
+
+  The file is a RingHeader followed by CAPACITY fixed-size RingRecords.
+  There is one writer.  Record N goes in slot N % CAPACITY, so a reader that
+  falls more than CAPACITY records behind loses the oldest ones; next() skips
+  ahead and counts them in lost().
+
+  Each slot has a sequence word that is odd while the writer is filling it
+  and 2 * (N + 1) once record N is complete.  A reader copies the record and
+  then checks that the word didn't change, so it never returns a record that
+  was overwritten while being copied.
+
+  A writer that opens an existing ring of the same capacity carries on
+  after its last record, so a reader following the ring across scanport
+  runs misses nothing.  Any other file at that path is replaced, not
+  rewritten, so readers that have it mapped never see it change under
+  them; they have to open the new ring to follow it.
+
+  Copyright (c) 2013, Michael Cook <michael@waxrat.com>. All rights reserved.
+*/
+
+#ifndef SCANPORT_RING_H
+#define SCANPORT_RING_H
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace scanport
+{
+
+char const RING_MAGIC[8] = { 'S', 'C', 'A', 'N', 'R', 'N', 'G', '1' };
+
+struct RingHeader
+{
+  char magic[8];                // RING_MAGIC
+  uint32_t record_size;         // sizeof(RingRecord)
+  uint32_t capacity;            // number of slots, a power of two
+  char pad1[48];
+  std::atomic<uint64_t> next;   // number of records written so far
+  char pad2[56];
+};
+
+/* One probe result.  Addresses and ports are in host byte order. */
+struct RingRecord
+{
+  std::atomic<uint64_t> seq;
+  uint32_t addr;
+  uint16_t port;
+  uint8_t outcome;              // 0 open, 1 refused, 2 timeout,
+                                // 3 unreachable, 4 closed
+  uint8_t reserved;
+  uint32_t latency_us;          // time to answer, 0 if none
+  uint32_t reserved2;
+  int64_t time_us;              // wall clock, microseconds since the epoch
+};
+
+static_assert(sizeof(RingHeader) == 128, "RingHeader layout");
+static_assert(sizeof(RingRecord) == 32, "RingRecord layout");
+
+class RingWriter
+{
+public:
+  /* Map the ring at PATH, of CAPACITY records, a power of two, creating it
+     or carrying on from its last record as described above. */
+  RingWriter(std::string const& path, uint32_t capacity)
+    : capacity_(capacity)
+  {
+    if (capacity == 0 or (capacity & (capacity - 1)) != 0)
+      throw std::runtime_error("Ring size must be a power of two");
+    size_ = sizeof(RingHeader) + size_t(capacity) * sizeof(RingRecord);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+      throw std::runtime_error("open " + path + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+      fail(fd, "fstat " + path);
+    if (size_t(st.st_size) == size_)
+    {
+      map(fd, path);
+      if (memcmp(header_->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 or
+          header_->record_size != sizeof(RingRecord) or
+          header_->capacity != capacity)
+      {
+        munmap(header_, size_);
+        header_ = nullptr;
+      }
+    }
+    if (header_ == nullptr and st.st_size != 0)
+    {
+      close(fd);
+      if (unlink(path.c_str()) == -1 and errno != ENOENT)
+        throw std::runtime_error("unlink " + path + ": " + strerror(errno));
+      fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      if (fd == -1)
+        throw std::runtime_error("open " + path + ": " + strerror(errno));
+    }
+    if (header_ == nullptr)
+    {
+      if (ftruncate(fd, size_) == -1)
+        fail(fd, "ftruncate " + path);
+      map(fd, path);
+      header_->record_size = sizeof(RingRecord);
+      header_->capacity = capacity;
+      // Readers check the magic last.
+      std::atomic_thread_fence(std::memory_order_release);
+      memcpy(header_->magic, RING_MAGIC, sizeof(RING_MAGIC));
+    }
+    close(fd);
+    next_ = header_->next.load(std::memory_order_acquire);
+  }
+
+  ~RingWriter()
+  {
+    munmap(header_, size_);
+  }
+
+  RingWriter(RingWriter const&) = delete;
+  RingWriter& operator=(RingWriter const&) = delete;
+
+  void write(uint32_t addr, uint16_t port, uint8_t outcome,
+             uint32_t latency_us, int64_t time_us)
+  {
+    RingRecord& rec = records_[next_ & (capacity_ - 1)];
+    rec.seq.store(2 * next_ + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    rec.addr = addr;
+    rec.port = port;
+    rec.outcome = outcome;
+    rec.latency_us = latency_us;
+    rec.time_us = time_us;
+    rec.seq.store(2 * (next_ + 1), std::memory_order_release);
+    header_->next.store(++next_, std::memory_order_release);
+  }
+
+private:
+  void map(int fd, std::string const& path)
+  {
+    void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      fail(fd, "mmap " + path);
+    header_ = static_cast<RingHeader*>(p);
+    records_ = reinterpret_cast<RingRecord*>(header_ + 1);
+  }
+
+  [[noreturn]] static void fail(int fd, std::string const& what)
+  {
+    int err = errno;
+    close(fd);
+    throw std::runtime_error(what + ": " + strerror(err));
+  }
+
+  uint32_t capacity_;
+  size_t size_;
+  RingHeader* header_ = nullptr;
+  RingRecord* records_ = nullptr;
+  uint64_t next_ = 0;
+};
+
+class RingReader
+{
+public:
+  /* Map the ring at PATH.  Reading starts with the oldest record still in
+     the ring. */
+  explicit RingReader(std::string const& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      throw std::runtime_error("open " + path + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) == -1 or size_t(st.st_size) < sizeof(RingHeader))
+    {
+      close(fd);
+      throw std::runtime_error(path + ": Not a scanport ring");
+    }
+    size_ = st.st_size;
+    void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("mmap " + path + ": " + strerror(errno));
+    header_ = static_cast<RingHeader const*>(p);
+    records_ = reinterpret_cast<RingRecord const*>(header_ + 1);
+    if (memcmp(header_->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 or
+        header_->record_size != sizeof(RingRecord) or
+        header_->capacity == 0 or
+        (header_->capacity & (header_->capacity - 1)) != 0 or
+        size_ < sizeof(RingHeader) + header_->capacity * sizeof(RingRecord))
+    {
+      munmap(p, size_);
+      throw std::runtime_error(path + ": Not a scanport ring");
+    }
+    uint64_t next = header_->next.load(std::memory_order_acquire);
+    cursor_ = next > header_->capacity ? next - header_->capacity : 0;
+  }
+
+  ~RingReader()
+  {
+    munmap(const_cast<RingHeader*>(header_), size_);
+  }
+
+  RingReader(RingReader const&) = delete;
+  RingReader& operator=(RingReader const&) = delete;
+
+  /* Copy the next record into OUT and return true, or return false if
+     there is no new record yet. */
+  bool next(RingRecord& out)
+  {
+    uint32_t const capacity = header_->capacity;
+    for (;;)
+    {
+      uint64_t next = header_->next.load(std::memory_order_acquire);
+      if (cursor_ >= next)
+        return false;
+      if (next - cursor_ > capacity)
+      {
+        lost_ += next - capacity - cursor_;
+        cursor_ = next - capacity;
+      }
+      RingRecord const& rec = records_[cursor_ & (capacity - 1)];
+      uint64_t const want = 2 * (cursor_ + 1);
+      uint64_t seq = rec.seq.load(std::memory_order_acquire);
+      if (seq == want)
+      {
+        memcpy(reinterpret_cast<char*>(&out) + sizeof(out.seq),
+               reinterpret_cast<char const*>(&rec) + sizeof(rec.seq),
+               sizeof(rec) - sizeof(rec.seq));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (rec.seq.load(std::memory_order_relaxed) == want)
+        {
+          out.seq.store(want, std::memory_order_relaxed);
+          ++cursor_;
+          return true;
+        }
+      }
+      if (seq < want)
+        return false;           // RingWriter never starts a ring over
+      // The slot has moved on to a later record: we were lapped.
+      ++lost_;
+      ++cursor_;
+    }
+  }
+
+  /* Number of records overwritten before they could be read. */
+  uint64_t lost() const { return lost_; }
+
+private:
+  RingHeader const* header_;
+  RingRecord const* records_;
+  size_t size_;
+  uint64_t cursor_ = 0;
+  uint64_t lost_ = 0;
+};
+
+} // namespace scanport
+
+#endif
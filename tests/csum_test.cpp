@@ -0,0 +1,217 @@
+/*
+  Tests of the Internet checksum routines in scanport.cpp: csum_add()
+  against a plain RFC 1071 sum, and the RFC 1624 updates that --syn applies
+  to its template packet against checksumming each packet in full.  With
+  --bench, how fast the two ways of checksumming a packet go.  The program
+  is built together with scanport.cpp, whose main() is renamed out of the
+  way:
+
+    g++ -Wall -Werror -std=c++11 -O2 -I. tests/csum_test.cpp -lpthread -o csum_test
+    ./csum_test
+    ./csum_test --bench
+
+  Copyright (c) 2013, Michael Cook <michael@waxrat.com>. All rights reserved.
+*/
+
+#define main scanport_main
+#include "scanport.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                     \
+  do                                                                    \
+    if (not (cond))                                                     \
+    {                                                                   \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,  \
+              #cond);                                                   \
+      ++failures;                                                       \
+    }                                                                   \
+  while (0)
+
+/* The checksum of the N bytes at P as RFC 1071 gives it: the complement of
+   the one's complement sum of big-endian 16-bit words, in network byte
+   order. */
+uint16_t rfc1071(unsigned char const* p, size_t n)
+{
+  uint32_t sum = 0;
+  for (size_t k = 0; k + 1 < n; k += 2)
+    sum += p[k] << 8 | p[k + 1];
+  if (n % 2)
+    sum += p[n - 1] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return htons(~sum & 0xffff);
+}
+
+/* csum_add() agrees with the plain sum whatever the length and alignment
+   of the buffer. */
+void test_csum_add()
+{
+  std::mt19937 rng(1);
+  unsigned char buf[1600];
+  for (int k = 0; k < 20000; ++k)
+  {
+    size_t offset = rng() % 8;
+    size_t n = rng() % (sizeof(buf) - offset);
+    for (size_t j = 0; j < n; ++j)
+      buf[offset + j] = rng();
+    CHECK(csum_fold(csum_add(buf + offset, n, 0)) ==
+          rfc1071(buf + offset, n));
+  }
+  // Sums big enough to carry out of 32 bits many times over.
+  memset(buf, 0xff, sizeof(buf));
+  CHECK(csum_fold(csum_add(buf, sizeof(buf), 0)) ==
+        rfc1071(buf, sizeof(buf)));
+}
+
+/* Fill in the IP and TCP checksums of PKT, of LEN bytes, from scratch. */
+void full_checksums(SynPacket& pkt, size_t len)
+{
+  pkt.ip.check = 0;
+  pkt.ip.check = csum_fold(csum_add(&pkt.ip, sizeof(pkt.ip), 0));
+  struct
+  {
+    uint32_t saddr, daddr;
+    uint8_t zero, protocol;
+    uint16_t length;
+  } pseudo{ pkt.ip.saddr, pkt.ip.daddr, 0, IPPROTO_TCP,
+            htons(len - sizeof(pkt.ip)) };
+  pkt.tcp.check = 0;
+  uint64_t sum = csum_add(&pseudo, sizeof(pseudo), 0);
+  pkt.tcp.check = csum_fold(csum_add(&pkt.tcp, len - sizeof(pkt.ip), sum));
+}
+
+/* A template like syn_scan()'s, with daddr and seq zero. */
+SynPacket make_template(size_t len, uint32_t saddr, uint16_t sport)
+{
+  SynPacket pkt{};
+  pkt.ip.version = 4;
+  pkt.ip.ihl = sizeof(iphdr) / 4;
+  pkt.ip.tot_len = htons(len);
+  pkt.ip.id = htons(4321);
+  pkt.ip.ttl = 64;
+  pkt.ip.protocol = IPPROTO_TCP;
+  pkt.ip.saddr = saddr;
+  pkt.tcp.source = htons(sport);
+  pkt.tcp.dest = htons(80);
+  pkt.tcp.doff = len / 4 - sizeof(iphdr) / 4;
+  pkt.tcp.syn = 1;
+  pkt.tcp.window = htons(1024);
+  pkt.options[0] = TCPOPT_MAXSEG;
+  pkt.options[1] = TCPOLEN_MAXSEG;
+  pkt.options[2] = 1460 >> 8;
+  pkt.options[3] = 1460 & 0xff;
+  full_checksums(pkt, len);
+  return pkt;
+}
+
+/* Patching daddr, seq and the port word into the template, one packet
+   after another as syn_scan() does, leaves the same checksums as working
+   them out afresh; and both the IP and TCP checksums verify. */
+void test_incremental()
+{
+  std::mt19937 rng(2);
+  for (size_t len : { sizeof(iphdr) + sizeof(tcphdr) + 4,
+                      sizeof(SynPacket) })
+  {
+    SynPacket pkt = make_template(len, htonl(0x0a3c0301), 40000);
+    for (int k = 0; k < 100000; ++k)
+    {
+      uint32_t daddr = rng(), seq = rng();
+      csum_replace4(pkt.ip.check, pkt.ip.daddr, daddr);
+      csum_replace4(pkt.tcp.check, pkt.ip.daddr, daddr);
+      csum_replace4(pkt.tcp.check, pkt.tcp.seq, seq);
+      pkt.ip.daddr = daddr;
+      pkt.tcp.seq = seq;
+      if (k % 7 == 0)
+      {
+        // A new source port, which shares a 32-bit word with dest.
+        uint32_t from, to;
+        memcpy(&from, &pkt.tcp.source, 4);
+        pkt.tcp.source = htons(32768 + rng() % 28000);
+        memcpy(&to, &pkt.tcp.source, 4);
+        csum_replace4(pkt.tcp.check, from, to);
+      }
+      SynPacket full = pkt;
+      full_checksums(full, len);
+      CHECK(pkt.ip.check == full.ip.check);
+      CHECK(pkt.tcp.check == full.tcp.check);
+      if (pkt.ip.check != full.ip.check or pkt.tcp.check != full.tcp.check)
+        return;
+      // A packet with a correct checksum sums to zero.
+      CHECK(csum_fold(csum_add(&pkt.ip, sizeof(pkt.ip), 0)) == 0);
+    }
+  }
+
+  // All ones and all zeros are the awkward values for one's complement.
+  SynPacket pkt = make_template(sizeof(SynPacket), 0, 0);
+  for (uint32_t daddr : { 0xffffffffu, 0u, 0xffff0000u, 0x0000ffffu, 0u })
+  {
+    csum_replace4(pkt.ip.check, pkt.ip.daddr, daddr);
+    csum_replace4(pkt.tcp.check, pkt.ip.daddr, daddr);
+    pkt.ip.daddr = daddr;
+    SynPacket full = pkt;
+    full_checksums(full, sizeof(pkt));
+    CHECK(csum_fold(csum_add(&pkt.ip, sizeof(pkt.ip), 0)) == 0);
+    CHECK(csum_fold(csum_add(&full.ip, sizeof(full.ip), 0)) == 0);
+  }
+}
+
+double seconds_since(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/* Packets a second checksummed in full, and with the updates syn_scan()
+   uses, on one core. */
+void bench()
+{
+  size_t const packets = 20000000;
+  SynPacket pkt = make_template(sizeof(SynPacket), htonl(0x0a3c0301), 40000);
+  uint32_t check = 0;
+  auto start = Clock::now();
+  for (uint32_t k = 0; k < packets; ++k)
+  {
+    pkt.ip.daddr = k * 2654435761u;
+    pkt.tcp.seq = k;
+    full_checksums(pkt, sizeof(pkt));
+    check += pkt.tcp.check;
+  }
+  double secs = seconds_since(start);
+  printf("full: %.0f packets/s (%u)\n", packets / secs, check);
+
+  start = Clock::now();
+  for (uint32_t k = 0; k < packets; ++k)
+  {
+    uint32_t daddr = k * 2654435761u;
+    csum_replace4(pkt.ip.check, pkt.ip.daddr, daddr);
+    csum_replace4(pkt.tcp.check, pkt.ip.daddr, daddr);
+    csum_replace4(pkt.tcp.check, pkt.tcp.seq, k);
+    pkt.ip.daddr = daddr;
+    pkt.tcp.seq = k;
+    check += pkt.tcp.check;
+  }
+  secs = seconds_since(start);
+  printf("incremental: %.0f packets/s (%u)\n", packets / secs, check);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  test_csum_add();
+  test_incremental();
+  if (failures)
+  {
+    fprintf(stderr, "csum_test: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("csum_test: ok\n");
+  if (argc > 1 and strcmp(argv[1], "--bench") == 0)
+    bench();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+/*
+  Tests of the IPv4 text routines and the HTTP response head parser in
+  scanport.cpp, and with --bench, how fast they go.  The program is built
+  together with scanport.cpp, whose main() is renamed out of the way:
+
+    g++ -Wall -Werror -std=c++11 -O2 -I. tests/parse_test.cpp -lpthread -o parse_test
+    ./parse_test
+    ./parse_test --bench
+
+  The benchmark formats and parses 100M addresses.  The parsers are scalar
+  on purpose: addresses are at most 15 chars and HttpHead finds each line
+  with memchr(), which glibc already vectorizes, so there is too little
+  left per call for SIMD code to win back its setup.
+
+  Copyright (c) 2013, Michael Cook <michael@waxrat.com>. All rights reserved.
+*/
+
+#define main scanport_main
+#include "scanport.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                     \
+  do                                                                    \
+    if (not (cond))                                                     \
+    {                                                                   \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,  \
+              #cond);                                                   \
+      ++failures;                                                       \
+    }                                                                   \
+  while (0)
+
+bool parses(std::string const& text, uint32_t& addr)
+{
+  char const* p = text.data();
+  return parse_ipv4(p, text.data() + text.size(), addr) and
+    p == text.data() + text.size();
+}
+
+/* format_ipv4() agrees with inet_ntop(), and parse_ipv4() reads back what
+   it wrote. */
+void test_ipv4()
+{
+  std::mt19937 rng(1);
+  std::vector<uint32_t> addrs{ 0, 1, 0x7f000001, 0x0a3c0307, 0xc0a80001,
+                               0xffffffff, 0x01020304, 0x64646464 };
+  for (int k = 0; k < 100000; ++k)
+    addrs.push_back(rng());
+  for (auto addr : addrs)
+  {
+    char want[INET_ADDRSTRLEN];
+    in_addr in{ htonl(addr) };
+    inet_ntop(AF_INET, &in, want, sizeof(want));
+    std::string text = ipv4_string(addr);
+    CHECK(text == want);
+    uint32_t back = 0;
+    CHECK(parses(text, back) and back == addr);
+  }
+  uint32_t addr;
+  for (char const* bad : { "", "1.2.3", "1.2.3.", "1..2.3", ".1.2.3",
+                           "256.1.1.1", "1.2.3.256", "a.b.c.d", "1.2.3.-4",
+                           "1,2,3,4" })
+    CHECK(not parses(bad, addr));
+
+  // Only what is an address is taken, the rest left for the caller.
+  std::string subnet = "10.60.3.0/24";
+  char const* p = subnet.data();
+  CHECK(parse_ipv4(p, subnet.data() + subnet.size(), addr));
+  CHECK(addr == 0x0a3c0300 and *p == '/');
+}
+
+std::string const HEAD =
+  "HTTP/1.1 301 Moved Permanently\r\n"
+  "Server: nginx/1.24.0\r\n"
+  "Date: Sun, 18 Oct 2026 12:00:00 GMT\r\n"
+  "Content-Type: text/html\r\n"
+  "Content-Length: 169\r\n"
+  "Connection: keep-alive\r\n"
+  "location:   https://example.com/   \r\n"
+  "\r\n"
+  "<html>";
+
+std::vector<std::string> const WANTED{ "Server", "Location", "X-Missing" };
+
+std::string value(HttpHead const& head, std::string const& buf, size_t i)
+{
+  auto const& v = head.value(i);
+  return v.found ? buf.substr(v.begin, v.size) : "(none)";
+}
+
+/* Parsing the head all at once finds the status and the wanted headers,
+   whatever their case, without the spaces around them. */
+void test_head_whole()
+{
+  HttpHead head(WANTED);
+  CHECK(head.parse(HEAD.data(), HEAD.size()) == HttpHead::complete);
+  CHECK(head.status() == 301);
+  CHECK(value(head, HEAD, 0) == "nginx/1.24.0");
+  CHECK(value(head, HEAD, 1) == "https://example.com/");
+  CHECK(value(head, HEAD, 2) == "(none)");
+
+  // Bare LFs do too.
+  std::string lf = "HTTP/1.0 200 OK\nServer: x\n\n";
+  head.reset();
+  CHECK(head.parse(lf.data(), lf.size()) == HttpHead::complete);
+  CHECK(head.status() == 200 and value(head, lf, 0) == "x");
+}
+
+/* A head that arrives in pieces of any size, the buffer growing with each
+   read, parses the same as one that arrives whole, including when a piece
+   ends between the CR and the LF. */
+void test_head_split()
+{
+  HttpHead head(WANTED);
+  for (size_t piece = 1; piece <= HEAD.size(); ++piece)
+  {
+    head.reset();
+    HttpHead::State state = HttpHead::partial;
+    size_t n = 0;
+    while (state == HttpHead::partial and n < HEAD.size())
+    {
+      n = std::min(HEAD.size(), n + piece);
+      state = head.parse(HEAD.data(), n);
+    }
+    CHECK(state == HttpHead::complete);
+    CHECK(head.status() == 301);
+    CHECK(value(head, HEAD, 0) == "nginx/1.24.0");
+    CHECK(value(head, HEAD, 1) == "https://example.com/");
+    CHECK(value(head, HEAD, 2) == "(none)");
+  }
+
+  // Nothing is decided before the status line is whole.
+  std::string status = "HTTP/1.1 20";
+  head.reset();
+  CHECK(head.parse(status.data(), status.size()) == HttpHead::partial);
+  CHECK(head.status() == 0);
+}
+
+/* A head bigger than the receive buffer stays partial when the buffer is
+   full.  The headers before the cut are there; one cut in two isn't taken
+   for a complete value. */
+void test_head_oversized()
+{
+  std::string big = "HTTP/1.1 200 OK\r\nServer: big\r\n";
+  while (big.size() < BufferPool::SIZE - 20)
+    big += "X-Filler: " + std::string(60, 'f') + "\r\n";
+  big += "Location: https://example.com/a/very/long/path\r\n\r\n";
+  CHECK(big.size() > BufferPool::SIZE);
+  HttpHead head(WANTED);
+  CHECK(head.parse(big.data(), BufferPool::SIZE) == HttpHead::partial);
+  CHECK(head.status() == 200);
+  CHECK(value(head, big, 0) == "big");
+  CHECK(not head.value(1).found);
+  CHECK(head.parse(big.data(), big.size()) == HttpHead::complete);
+  CHECK(value(head, big, 1) == "https://example.com/a/very/long/path");
+}
+
+void test_head_invalid()
+{
+  HttpHead head(WANTED);
+  for (char const* text : { "SSH-2.0-OpenSSH_9.6\r\n",
+                            "HTTP/2 200\r\n",
+                            "HTTP/1.1 2x0 OK\r\n",
+                            "HTTP/1.1 20\r\n",
+                            "\r\n" })
+  {
+    head.reset();
+    CHECK(head.parse(text, strlen(text)) == HttpHead::invalid);
+  }
+}
+
+double seconds_since(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/* Throughput of the parsers, on one core. */
+void bench()
+{
+  size_t const heads = 2000000;
+  HttpHead head(WANTED);
+  size_t found = 0;
+  auto start = Clock::now();
+  for (size_t k = 0; k < heads; ++k)
+  {
+    head.reset();
+    if (head.parse(HEAD.data(), HEAD.size()) == HttpHead::complete)
+      found += head.value(0).size;
+  }
+  double secs = seconds_since(start);
+  printf("HttpHead::parse: %.0f heads/s, %.0f MB/s (%zu)\n", heads / secs,
+         heads * HEAD.size() / secs / 1e6, found);
+
+  // The same head arriving in 16-byte reads.
+  start = Clock::now();
+  for (size_t k = 0; k < heads; ++k)
+  {
+    head.reset();
+    for (size_t n = 16; ; n += 16)
+      if (head.parse(HEAD.data(), std::min(n, HEAD.size())) !=
+          HttpHead::partial)
+        break;
+    found += head.value(0).size;
+  }
+  secs = seconds_since(start);
+  printf("HttpHead::parse in 16-byte reads: %.0f heads/s (%zu)\n",
+         heads / secs, found);
+
+  size_t const addrs = 100000000;
+  char buf[IPV4_MAXLEN + 1];
+  size_t chars = 0;
+  start = Clock::now();
+  for (uint32_t a = 0; a < addrs; ++a)
+    chars += format_ipv4(a * 2654435761u, buf);
+  secs = seconds_since(start);
+  printf("format_ipv4: %.0f addresses/s (%zu)\n", addrs / secs, chars);
+
+  std::vector<std::string> texts;
+  for (uint32_t a = 0; a < 4096; ++a)
+    texts.push_back(ipv4_string(a * 2654435761u));
+  uint32_t sum = 0;
+  start = Clock::now();
+  for (size_t k = 0; k < addrs; ++k)
+  {
+    std::string const& text = texts[k & 4095];
+    char const* p = text.data();
+    uint32_t addr;
+    if (parse_ipv4(p, text.data() + text.size(), addr))
+      sum += addr;
+  }
+  secs = seconds_since(start);
+  printf("parse_ipv4: %.0f addresses/s (%u)\n", addrs / secs, sum);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  test_ipv4();
+  test_head_whole();
+  test_head_split();
+  test_head_oversized();
+  test_head_invalid();
+  if (failures)
+  {
+    fprintf(stderr, "parse_test: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("parse_test: ok\n");
+  if (argc > 1 and strcmp(argv[1], "--bench") == 0)
+    bench();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+/*
+  Tests of the result ring in scanport_ring.h: a reader following a writer
+  that runs at the same time, one that falls behind, and one that follows
+  the ring across writers that stop and start again.
+
+    g++ -Wall -Werror -std=c++11 -O2 -I. tests/ring_test.cpp -lpthread -o ring_test
+    ./ring_test
+
+  Copyright (c) 2013, Michael Cook <michael@waxrat.com>. All rights reserved.
+*/
+
+#include "scanport_ring.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                     \
+  do                                                                    \
+    if (not (cond))                                                     \
+    {                                                                   \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,  \
+              #cond);                                                   \
+      ++failures;                                                       \
+    }                                                                   \
+  while (0)
+
+std::string ring_path()
+{
+  char const* dir = getenv("TMPDIR");
+  return std::string(dir ? dir : "/tmp") + "/ring_test." +
+    std::to_string(getpid());
+}
+
+/* Record N of a run carries N in addr and the run in port. */
+void write_run(scanport::RingWriter& writer, uint16_t run, uint32_t count,
+               uint32_t first = 0)
+{
+  for (uint32_t n = first; n < first + count; ++n)
+    writer.write(n, run, n % 5, n, n);
+}
+
+/* Write records 0 to COUNT - 1 at PER_SECOND records a second, in bursts
+   of a thousand. */
+void write_paced(scanport::RingWriter& writer, uint32_t count,
+                 uint32_t per_second)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t n = 0; n < count; n += 1000)
+  {
+    std::this_thread::sleep_until(
+      start + std::chrono::microseconds(uint64_t(n) * 1000000 / per_second));
+    write_run(writer, 1, std::min(1000u, count - n), n);
+  }
+}
+
+struct Got
+{
+  uint32_t addr;
+  uint16_t port;
+};
+
+/* Read everything there is now. */
+std::vector<Got> drain(scanport::RingReader& reader)
+{
+  std::vector<Got> got;
+  scanport::RingRecord rec;
+  while (reader.next(rec))
+    got.push_back(Got{ rec.addr, rec.port });
+  return got;
+}
+
+/* A reader following a writer in another thread that produces 1M results
+   a second, through a ring holding a small fraction of them, keeps up: it
+   gets every record, in order, intact.  One that sleeps now and then while
+   the writer goes flat out loses some, but what it gets is still in order,
+   and it counts exactly what it lost. */
+void test_concurrent(bool slow)
+{
+  std::string path = ring_path();
+  unlink(path.c_str());
+  uint32_t const total = 2000000;
+  scanport::RingWriter writer(path, slow ? 1 << 12 : 1 << 14);
+  scanport::RingReader reader(path);
+  std::thread thread([&writer, slow]() {
+      if (slow)
+        write_run(writer, 1, total);
+      else
+        write_paced(writer, total, 1000000);
+    });
+  uint64_t got = 0;
+  bool ordered = true, intact = true;
+  scanport::RingRecord rec;
+  while (got + reader.lost() < total)
+  {
+    if (not reader.next(rec))
+      continue;
+    if (rec.addr != got + reader.lost())
+      ordered = false;
+    if (rec.port != 1 or rec.outcome != rec.addr % 5 or
+        rec.latency_us != rec.addr or rec.time_us != rec.addr)
+      intact = false;
+    if (++got % 1000 == 0 and slow)
+      usleep(100);
+  }
+  thread.join();
+  CHECK(ordered);
+  CHECK(intact);
+  CHECK(got + reader.lost() == total);
+  CHECK(not reader.next(rec));
+  if (slow)
+    CHECK(reader.lost() > 0);
+  else
+    CHECK(reader.lost() == 0);
+  unlink(path.c_str());
+}
+
+/* A reader following the ring across three runs of the writer gets every
+   record of each. */
+void test_restart()
+{
+  std::string path = ring_path();
+  unlink(path.c_str());
+  {
+    scanport::RingWriter writer(path, 8);
+    write_run(writer, 1, 3);
+  }
+  scanport::RingReader reader(path);
+  auto got = drain(reader);
+  CHECK(got.size() == 3);
+  for (uint16_t run = 2; run <= 3; ++run)
+  {
+    scanport::RingWriter writer(path, 8);
+    write_run(writer, run, 3, 3 * (run - 1));
+  }
+  auto more = drain(reader);
+  got.insert(got.end(), more.begin(), more.end());
+  CHECK(got.size() == 9);
+  CHECK(reader.lost() == 0);
+  for (size_t n = 0; n < got.size() and n < 9; ++n)
+  {
+    CHECK(got[n].addr == n);
+    CHECK(got[n].port == n / 3 + 1);
+  }
+
+  // A ring of another size takes the place of the file; the old reader
+  // stays valid but sees no more, and a new one reads the new ring.
+  {
+    scanport::RingWriter writer(path, 16);
+    write_run(writer, 4, 2);
+  }
+  CHECK(drain(reader).empty());
+  scanport::RingReader fresh(path);
+  auto again = drain(fresh);
+  CHECK(again.size() == 2);
+  CHECK(not again.empty() and again[0].port == 4 and again[0].addr == 0);
+  unlink(path.c_str());
+}
+
+/* A file that isn't a ring is replaced by one. */
+void test_not_a_ring()
+{
+  std::string path = ring_path();
+  FILE* f = fopen(path.c_str(), "w");
+  CHECK(f != nullptr);
+  if (f)
+  {
+    fputs("not a ring\n", f);
+    fclose(f);
+  }
+  {
+    scanport::RingWriter writer(path, 4);
+    write_run(writer, 1, 6);
+  }
+  scanport::RingReader reader(path);
+  auto got = drain(reader);
+  CHECK(got.size() == 4);
+  CHECK(not got.empty() and got[0].addr == 2);
+  unlink(path.c_str());
+}
+
+} // namespace
+
+int main()
+{
+  try
+  {
+    test_concurrent(false);
+    test_concurrent(true);
+    test_restart();
+    test_not_a_ring();
+  }
+  catch (std::exception& exc)
+  {
+    fprintf(stderr, "ring_test: %s\n", exc.what());
+    return EXIT_FAILURE;
+  }
+  if (failures)
+  {
+    fprintf(stderr, "ring_test: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("ring_test: ok\n");
+  return EXIT_SUCCESS;
+}
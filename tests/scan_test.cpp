@@ -0,0 +1,118 @@
+/*
+  Tests of whole scans in scanport.cpp, run in a child process so that a
+  scan that hangs or exits can be seen from outside.  connect() is replaced
+  here, so that a probe can be made to fail as a netfilter rule would make
+  it.  The program is built together with scanport.cpp, whose main() is
+  renamed out of the way:
+
+    g++ -Wall -Werror -std=c++11 -O2 -I. tests/scan_test.cpp -lpthread -ldl -o scan_test
+    ./scan_test
+
+  Copyright (c) 2013, Michael Cook <michael@waxrat.com>. All rights reserved.
+*/
+
+#define main scanport_main
+#include "scanport.cpp"
+#undef main
+
+#include <dlfcn.h>
+
+/* connect() to 127.0.0.2 fails with EPERM, as if an OUTPUT rule rejected
+   it; anything else goes to the real connect(). */
+extern "C" int connect(int fd, sockaddr const* sa, socklen_t len)
+{
+  using Connect = int (*)(int, sockaddr const*, socklen_t);
+  static Connect real = (Connect) dlsym(RTLD_NEXT, "connect");
+  if (sa->sa_family == AF_INET and
+      reinterpret_cast<sockaddr_in const*>(sa)->sin_addr.s_addr ==
+      htonl(0x7f000002))
+  {
+    errno = EPERM;
+    return -1;
+  }
+  return real(fd, sa, len);
+}
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                     \
+  do                                                                    \
+    if (not (cond))                                                     \
+    {                                                                   \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,  \
+              #cond);                                                   \
+      ++failures;                                                       \
+    }                                                                   \
+  while (0)
+
+/* Run scanport with ARGS in a child, with its output thrown away, and
+   return its wait status, or -1 if it was still running after SECS. */
+int run_scan(std::vector<char const*> args, unsigned secs)
+{
+  args.insert(args.begin(), "scanport");
+  args.push_back(nullptr);
+  pid_t pid = fork();
+  if (pid == -1)
+    throw std::runtime_error("fork: " + errStr());
+  if (pid == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    _exit(scanport_main(args.size() - 1, const_cast<char**>(args.data())));
+  }
+  auto deadline = Clock::now() + std::chrono::seconds(secs);
+  int status;
+  while (waitpid(pid, &status, WNOHANG) == 0)
+  {
+    if (Clock::now() >= deadline)
+    {
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      return -1;
+    }
+    usleep(10000);
+  }
+  return status;
+}
+
+bool failed(int status)
+{
+  return status != -1 and WIFEXITED(status) and
+    WEXITSTATUS(status) == EXIT_FAILURE;
+}
+
+/* A probe that throws ends the scan with its error, also when the main
+   thread is running the event loop for --http or --banner meanwhile. */
+void test_probe_throws()
+{
+  CHECK(failed(run_scan({ "0.5", "9", "127.0.0.2" }, 10)));
+  CHECK(failed(run_scan({ "--http", "0.5", "9", "127.0.0.2" }, 10)));
+  CHECK(failed(run_scan({ "--banner", "0.5", "9", "127.0.0.1",
+                          "127.0.0.2" }, 10)));
+}
+
+} // namespace
+
+int main()
+{
+  try
+  {
+    test_probe_throws();
+  }
+  catch (std::exception& exc)
+  {
+    fprintf(stderr, "scan_test: %s\n", exc.what());
+    return EXIT_FAILURE;
+  }
+  if (failures)
+  {
+    fprintf(stderr, "scan_test: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("scan_test: ok\n");
+  return EXIT_SUCCESS;
+}